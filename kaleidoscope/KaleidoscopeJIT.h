@@ -37,6 +37,7 @@ private:
 
   DataLayout DL;
   MangleAndInterner Mangle;
+  JITTargetMachineBuilder JTMB;
 
   RTDyldObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
@@ -47,15 +48,16 @@ public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
                   JITTargetMachineBuilder JTMB, DataLayout DL)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+        JTMB(std::move(JTMB)),
         ObjectLayer(*this->ES,
                     []() { return std::make_unique<SectionMemoryManager>(); }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                     std::make_unique<ConcurrentIRCompiler>(this->JTMB)),
         MainJD(this->ES->createBareJITDylib("<main>")) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+    if (this->JTMB.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
@@ -73,14 +75,17 @@ public:
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    // compile for the CPU we are running on, so that its features (FMA, the
+    // wider vectors) are there for generated code to use
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
 
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(*JTMB),
                                              std::move(*DL));
   }
 
@@ -88,12 +93,25 @@ public:
 
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  // a target machine like the ones the JIT compiles with, for the target
+  // dependent analyses of IR level passes
+  Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+    return JTMB.createTargetMachine();
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  // make Name resolve to Addr, a function or data of the host process
+  Error defineHostSymbol(StringRef Name, void *Addr) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          {ExecutorAddr::fromPtr(Addr), JITSymbolFlags::Exported}}}));
+  }
+
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
@@ -1,36 +1,89 @@
 // not original work; original source: https://llvm.org/docs/tutorial/MyFirstLanguageFrontend/LangImpl02.html
 #include "KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/FoldingSet.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TrailingObjects.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/ElimAvailExtern.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/InductiveRangeCheckElimination.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimpleLoopUnswitch.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/InjectTLIMappings.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
-#include <map>
+#include <limits>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
+#if LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 using namespace llvm;
 using namespace llvm::orc;
@@ -38,9 +91,8 @@ using namespace llvm::orc;
 
 
 // forward declarations
-static void MainLoop();
-class ExprAST; 
-static std::unique_ptr<ExprAST> ParseExpression();
+class CompilerSession;
+class KBCWriter;
 
 // lexer
 
@@ -52,69 +104,260 @@ enum Token {
     // primary 
     tok_identifier = -4, 
     tok_number = -5,
+    // control
+    tok_if = -6,
+    tok_then = -7,
+    tok_else = -8,
+    tok_for = -9,
+    tok_in = -10,
+    // var definition
+    tok_var = -11,
+    // parallel loops
+    tok_parfor = -12,
+    tok_reduce = -13,
+    // memoized definition
+    tok_memo = -14,
+    // floating point mode of a definition
+    tok_precision = -15,
+    // extern without side effects
+    tok_pure = -16,
 };
 
-static std::string IdentifierStr; // filled in if tok_identifier
-static double NumVal;             // filled in if tok_number
+// SymbolID - Dense id of an interned identifier
+using SymbolID = unsigned;
 
+// identifiers interned up front by every SymbolTable, keywords first so the
+// lexer can tell them apart with a single compare
+enum KnownSymbol : SymbolID {
+    sym_def,
+    sym_extern,
+    sym_if,
+    sym_then,
+    sym_else,
+    sym_for,
+    sym_in,
+    sym_var,
+    sym_parfor,
+    sym_reduce,
+    sym_memo,
+    sym_precision,
+    sym_pure,
+    num_keywords,
 
-static int gettok() {
-    static int LastChar = ' ';
+    sym_anon_expr = num_keywords, // "__anon_expr"
 
-    // skip any whitespace
-    while (isspace(LastChar))
-        LastChar = getchar(); 
-    
-    // identifier: [a-zA-Z][a-zA-Z0-9]
-    if (isalpha(LastChar)) {             
-        IdentifierStr = LastChar;
-        while (isalnum((LastChar = getchar())))
-            IdentifierStr += LastChar;
+    // builtins: vector construction, lane access and reductions, and the
+    // length of an array. A call to one is generated inline, it never goes to
+    // a function
+    sym_vec4,
+    sym_vec8,
+    sym_lane,
+    sym_insertlane,
+    sym_shuffle,
+    sym_hadd,
+    sym_hmin,
+    sym_hmax,
+    sym_len,
+    num_known_symbols
+};
 
-        if (IdentifierStr == "def")
-            return tok_def; 
-        if (IdentifierStr == "extern")
-            return tok_extern;
-        return tok_identifier;
-    }
-    // number: [0-9.]+
-    if (isdigit(LastChar) || LastChar == '.') {
-        std::string NumStr; 
-        // not really correct, accepts [0-9].[0-9].[0-9.]
-        do {
-            NumStr += LastChar; 
-            LastChar = getchar(); 
-        } while (isdigit(LastChar) || LastChar == '.');
+static inline bool isBuiltin(SymbolID Sym) {
+    return Sym >= sym_vec4 && Sym < num_known_symbols;
+}
 
-        NumVal = strtod(NumStr.c_str(), 0); 
-        return tok_number;
-    }
-    // comment until end of line
-    if (LastChar == '#') {
-        do 
-            LastChar = getchar(); 
-        while (LastChar != EOF && LastChar != '\n' && LastChar != '\r'); 
+// token for each keyword, indexed by its KnownSymbol
+static const int KeywordTokens[num_keywords] = {
+    tok_def, tok_extern, tok_if, tok_then, tok_else, tok_for, tok_in, tok_var,
+    tok_parfor, tok_reduce, tok_memo, tok_precision, tok_pure,
+};
 
-        if (LastChar != EOF)
-            return gettok();
-    }
-    
-    // check for end of file
+// SymbolTable - Interns identifier spellings. Each distinct spelling is
+// copied once, and from then on names are passed around and compared as
+// SymbolIDs; the spellings stay put for the life of the table.
+class SymbolTable {
+    StringMap<SymbolID, BumpPtrAllocator> IDs;
+    std::vector<StringRef> Names;
+
+    public:
+        SymbolTable() {
+            for (const char *Keyword : {"def", "extern", "if", "then", "else", "for", "in", "var",
+                                        "parfor", "reduce", "memo", "precision", "pure"})
+                intern(Keyword);
+            intern("__anon_expr");
+            for (const char *Builtin : {"vec4", "vec8", "lane", "insertlane", "shuffle",
+                                        "hadd", "hmin", "hmax", "len"})
+                intern(Builtin);
+        }
+
+        SymbolID intern(StringRef Name) {
+            auto Res = IDs.try_emplace(Name, Names.size());
+            if (Res.second)
+                Names.push_back(Res.first->getKey());
+            return Res.first->second;
+        }
+
+        StringRef getName(SymbolID ID) const { return Names[ID]; }
+};
+
+// character classes, ASCII only, so they don't depend on the C locale
+static inline bool isSpaceChar(unsigned char C) {
+    return C == ' ' || (unsigned char)(C - '\t') <= '\r' - '\t';
+}
+static inline bool isAlphaChar(unsigned char C) {
+    return (unsigned char)((C | 0x20) - 'a') <= 'z' - 'a';
+}
+static inline bool isDigitChar(unsigned char C) {
+    return (unsigned char)(C - '0') <= 9;
+}
+static inline bool isAlnumChar(unsigned char C) {
+    return isAlphaChar(C) || isDigitChar(C);
+}
+
+// Vector versions of the classes above. Each returns a bitmask with bit i set
+// when byte i of the block at P is in the class. The AVX2 flavour looks at 32
+// bytes at a time, the SSE2 one at 16.
+#if defined(__SSE2__)
+static inline unsigned spaceMask16(const char *P) {
+    __m128i V = _mm_loadu_si128((const __m128i *)P);
+    // '\t'..'\r' is a 5 character range, (c - '\t') <= 4 as unsigned
+    __m128i R = _mm_sub_epi8(V, _mm_set1_epi8('\t'));
+    __m128i InRange = _mm_cmpeq_epi8(_mm_min_epu8(R, _mm_set1_epi8(4)), R);
+    __m128i Blank = _mm_cmpeq_epi8(V, _mm_set1_epi8(' '));
+    return _mm_movemask_epi8(_mm_or_si128(InRange, Blank));
+}
+
+static inline unsigned alnumMask16(const char *P) {
+    __m128i V = _mm_loadu_si128((const __m128i *)P);
+    __m128i L = _mm_sub_epi8(_mm_or_si128(V, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i Alpha = _mm_cmpeq_epi8(_mm_min_epu8(L, _mm_set1_epi8(25)), L);
+    __m128i D = _mm_sub_epi8(V, _mm_set1_epi8('0'));
+    __m128i Digit = _mm_cmpeq_epi8(_mm_min_epu8(D, _mm_set1_epi8(9)), D);
+    return _mm_movemask_epi8(_mm_or_si128(Alpha, Digit));
+}
+
+static inline unsigned eolMask16(const char *P) {
+    __m128i V = _mm_loadu_si128((const __m128i *)P);
+    return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+                                          _mm_cmpeq_epi8(V, _mm_set1_epi8('\r'))));
+}
+#endif
+
+#if defined(__AVX2__)
+static inline unsigned spaceMask32(const char *P) {
+    __m256i V = _mm256_loadu_si256((const __m256i *)P);
+    __m256i R = _mm256_sub_epi8(V, _mm256_set1_epi8('\t'));
+    __m256i InRange = _mm256_cmpeq_epi8(_mm256_min_epu8(R, _mm256_set1_epi8(4)), R);
+    __m256i Blank = _mm256_cmpeq_epi8(V, _mm256_set1_epi8(' '));
+    return _mm256_movemask_epi8(_mm256_or_si256(InRange, Blank));
+}
+
+static inline unsigned alnumMask32(const char *P) {
+    __m256i V = _mm256_loadu_si256((const __m256i *)P);
+    __m256i L = _mm256_sub_epi8(_mm256_or_si256(V, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i Alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(L, _mm256_set1_epi8(25)), L);
+    __m256i D = _mm256_sub_epi8(V, _mm256_set1_epi8('0'));
+    __m256i Digit = _mm256_cmpeq_epi8(_mm256_min_epu8(D, _mm256_set1_epi8(9)), D);
+    return _mm256_movemask_epi8(_mm256_or_si256(Alpha, Digit));
+}
+
+static inline unsigned eolMask32(const char *P) {
+    __m256i V = _mm256_loadu_si256((const __m256i *)P);
+    return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')),
+                                                _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\r'))));
+}
+#endif
+
+// skipSpace/skipAlnum/skipToEOL - Return the first character in [P, E) that
+// is not whitespace / not alphanumeric / is a line break. Whole blocks go
+// through the vector classifiers, the scalar loop only handles the tail.
+static const char *skipSpace(const char *P, const char *E) {
+#if defined(__AVX2__)
+    for (; E - P >= 32; P += 32)
+        if (unsigned M = ~spaceMask32(P))
+            return P + countr_zero(M);
+#endif
+#if defined(__SSE2__)
+    for (; E - P >= 16; P += 16)
+        if (unsigned M = ~spaceMask16(P) & 0xFFFF)
+            return P + countr_zero(M);
+#endif
+    while (P != E && isSpaceChar(*P))
+        ++P;
+    return P;
+}
 
-    if (LastChar == EOF)
-        return tok_eof; 
+static const char *skipAlnum(const char *P, const char *E) {
+#if defined(__AVX2__)
+    for (; E - P >= 32; P += 32)
+        if (unsigned M = ~alnumMask32(P))
+            return P + countr_zero(M);
+#endif
+#if defined(__SSE2__)
+    for (; E - P >= 16; P += 16)
+        if (unsigned M = ~alnumMask16(P) & 0xFFFF)
+            return P + countr_zero(M);
+#endif
+    while (P != E && isAlnumChar(*P))
+        ++P;
+    return P;
+}
 
-    // Otherwise, just return the character as it its ascii value
-    int ThisChar = LastChar; 
-    LastChar = getchar(); 
-    return ThisChar;
+static const char *skipToEOL(const char *P, const char *E) {
+#if defined(__AVX2__)
+    for (; E - P >= 32; P += 32)
+        if (unsigned M = eolMask32(P))
+            return P + countr_zero(M);
+#endif
+#if defined(__SSE2__)
+    for (; E - P >= 16; P += 16)
+        if (unsigned M = eolMask16(P))
+            return P + countr_zero(M);
+#endif
+    while (P != E && *P != '\n' && *P != '\r')
+        ++P;
+    return P;
 }
 
 // AST nodes
-class ExprAST {
+
+class ASTContext;
+
+// ExprAST - Base class for all expression nodes. Nodes are bump allocated from
+// the session's AST arena and all of a top-level item's nodes are dropped in
+// one go once it has been code generated, so they are never destroyed one by
+// one and must stay trivially destructible. There are no virtual methods;
+// the kind tag drives isa<>/cast<> and codegen dispatch.
+//
+// Nodes are hash-consed by ASTContext, so a node can have any number of
+// parents: the AST of an item is a DAG, and walks over it have to remember
+// the nodes they have already been through.
+class ExprAST : public FoldingSetNode {
+    public:
+        enum ExprKind {
+            EK_Number,
+            EK_Variable,
+            EK_Binary,
+            EK_Call,
+            EK_If,
+            EK_For,
+            EK_Var,
+            EK_Index,
+            EK_ParFor,
+        };
+
+    private:
+        const ExprKind Kind;
+
+    protected:
+        ExprAST(ExprKind Kind) : Kind(Kind) {}
+
     public:
-        virtual ~ExprAST() = default;
-        virtual Value *codegen() = 0;
+        ExprKind getKind() const { return Kind; }
+        void Profile(FoldingSetNodeID &ID) const;
+        // forEachOperand - Call F on each operand of this node, in order
+        template <typename FnT> void forEachOperand(FnT F) const;
+        Value *codegen(CompilerSession &S);
+        ExprAST *simplify(ASTContext &AST);
 };
 
 // NumberExprAST - Expression class for numeric literals like "1.0"
@@ -122,163 +365,966 @@ class NumberExprAST : public ExprAST {
     double Val; 
 
     public: 
-        NumberExprAST(double Val) : Val(Val) {}
-        Value *codegen() override;
+        NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
+        double getVal() const { return Val; }
+        Value *codegen(CompilerSession &S);
+
+        static void Profile(FoldingSetNodeID &ID, double Val) {
+            ID.AddInteger(EK_Number);
+            ID.AddInteger(bit_cast<uint64_t>(Val));
+        }
+
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
 };
 
 // VariableExprAST - Expression class for referencing a variable, like "a". 
 class VariableExprAST : public ExprAST {
-    std::string Name; 
+    SymbolID Name;
 
     public:
-        VariableExprAST(const std::string &Name) : Name(Name) {}
-        Value *codegen() override;
+        VariableExprAST(SymbolID Name) : ExprAST(EK_Variable), Name(Name) {}
+        SymbolID getName() const { return Name; }
+        Value *codegen(CompilerSession &S);
+
+        static void Profile(FoldingSetNodeID &ID, SymbolID Name) {
+            ID.AddInteger(EK_Variable);
+            ID.AddInteger(Name);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
 };
 
 // BinaryExprAST - Expression class for binary operator
 class BinaryExprAST : public ExprAST {
     char Op; 
-    std::unique_ptr<ExprAST> LHS, RHS; 
+    ExprAST *LHS, *RHS;
 
     public: 
-        BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, 
-                std::unique_ptr<ExprAST> RHS) 
-            : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-        Value *codegen() override;
+        BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+            : ExprAST(EK_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+        char getOp() const { return Op; }
+        ExprAST *getLHS() const { return LHS; }
+        ExprAST *getRHS() const { return RHS; }
+        Value *codegen(CompilerSession &S, Value *L, Value *R);
+        Value *codegenAssign(CompilerSession &S, Value *Val, Value *IndexV);
+
+        static void Profile(FoldingSetNodeID &ID, char Op, ExprAST *LHS, ExprAST *RHS) {
+            ID.AddInteger(EK_Binary);
+            ID.AddInteger(Op);
+            ID.AddPointer(LHS);
+            ID.AddPointer(RHS);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
 };
 
-// CallExprAST - Expression class for function calls
-class CallExprAST : public ExprAST {
-    std::string Callee; 
-    std::vector<std::unique_ptr<ExprAST>> Args; 
+// CallExprAST - Expression class for function calls. The arguments are stored
+// inline, right after the node.
+class CallExprAST final : public ExprAST,
+                          private TrailingObjects<CallExprAST, ExprAST *> {
+    friend TrailingObjects;
+
+    SymbolID Callee;
+    unsigned NumArgs;
+    bool Shared; // may stand for every call like it, see ASTContext
+
+    CallExprAST(SymbolID Callee, ArrayRef<ExprAST *> Args, bool Shared)
+        : ExprAST(EK_Call), Callee(Callee), NumArgs(Args.size()), Shared(Shared) {
+        std::uninitialized_copy(Args.begin(), Args.end(),
+                                getTrailingObjects<ExprAST *>());
+    }
 
     public:
-        CallExprAST(const std::string &Callee, 
-                std::vector<std::unique_ptr<ExprAST>> Args)
-        : Callee(Callee), Args(std::move(Args)) {}
-        Value *codegen() override;
+        static CallExprAST *Create(BumpPtrAllocator &Arena, SymbolID Callee,
+                                   ArrayRef<ExprAST *> Args, bool Shared) {
+            void *Mem = Arena.Allocate(totalSizeToAlloc<ExprAST *>(Args.size()),
+                                       alignof(CallExprAST));
+            return new (Mem) CallExprAST(Callee, Args, Shared);
+        }
+
+        SymbolID getCallee() const { return Callee; }
+        bool isShared() const { return Shared; }
+        ArrayRef<ExprAST *> getArgs() const {
+            return {getTrailingObjects<ExprAST *>(), NumArgs};
+        }
+        Function *resolveCallee(CompilerSession &S);
+        Value *codegen(CompilerSession &S, Function *CalleeF, ArrayRef<Value *> ArgsV);
+        Value *codegenBuiltin(CompilerSession &S, ArrayRef<Value *> ArgsV);
+
+        static void Profile(FoldingSetNodeID &ID, SymbolID Callee,
+                            ArrayRef<ExprAST *> Args) {
+            ID.AddInteger(EK_Call);
+            ID.AddInteger(Callee);
+            for (ExprAST *Arg : Args)
+                ID.AddPointer(Arg);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+};
+
+// IfExprAST - Expression class for if/then/else
+class IfExprAST : public ExprAST {
+    ExprAST *Cond, *Then, *Else;
+
+    public: 
+        IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+            : ExprAST(EK_If), Cond(Cond), Then(Then), Else(Else) {}
+        ExprAST *getCond() const { return Cond; }
+        ExprAST *getThen() const { return Then; }
+        ExprAST *getElse() const { return Else; }
+
+        static void Profile(FoldingSetNodeID &ID, ExprAST *Cond, ExprAST *Then,
+                            ExprAST *Else) {
+            ID.AddInteger(EK_If);
+            ID.AddPointer(Cond);
+            ID.AddPointer(Then);
+            ID.AddPointer(Else);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
+};
+
+// ForExprAST - Expression class for for/in
+class ForExprAST : public ExprAST {
+    SymbolID VarName;
+    ExprAST *Start, *End, *Step, *Body; // Step is null when omitted
+
+    public: 
+        ForExprAST(SymbolID VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+                   ExprAST *Body)
+            : ExprAST(EK_For), VarName(VarName), Start(Start), End(End),
+              Step(Step), Body(Body) {}
+        SymbolID getVarName() const { return VarName; }
+        ExprAST *getStart() const { return Start; }
+        ExprAST *getEnd() const { return End; }
+        ExprAST *getStep() const { return Step; }
+        ExprAST *getBody() const { return Body; }
+
+        static void Profile(FoldingSetNodeID &ID, SymbolID VarName, ExprAST *Start,
+                            ExprAST *End, ExprAST *Step, ExprAST *Body) {
+            ID.AddInteger(EK_For);
+            ID.AddInteger(VarName);
+            ID.AddPointer(Start);
+            ID.AddPointer(End);
+            ID.AddPointer(Step);
+            ID.AddPointer(Body);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+};
+
+// VarBinding - One variable of a var/in, with its initializer if it has one
+struct VarBinding {
+    SymbolID Name;
+    ExprAST *Init; // null for 0.0
+};
+
+// VarExprAST - Expression class for var/in. The bindings are stored inline,
+// right after the node.
+class VarExprAST final : public ExprAST,
+                         private TrailingObjects<VarExprAST, VarBinding> {
+    friend TrailingObjects;
+
+    unsigned NumBindings;
+    ExprAST *Body;
+
+    VarExprAST(ArrayRef<VarBinding> Bindings, ExprAST *Body)
+        : ExprAST(EK_Var), NumBindings(Bindings.size()), Body(Body) {
+        std::uninitialized_copy(Bindings.begin(), Bindings.end(),
+                                getTrailingObjects<VarBinding>());
+    }
+
+    public: 
+        static VarExprAST *Create(BumpPtrAllocator &Arena,
+                                  ArrayRef<VarBinding> Bindings, ExprAST *Body) {
+            void *Mem = Arena.Allocate(totalSizeToAlloc<VarBinding>(Bindings.size()),
+                                       alignof(VarExprAST));
+            return new (Mem) VarExprAST(Bindings, Body);
+        }
+
+        ArrayRef<VarBinding> getBindings() const {
+            return {getTrailingObjects<VarBinding>(), NumBindings};
+        }
+        ExprAST *getBody() const { return Body; }
+
+        static void Profile(FoldingSetNodeID &ID, ArrayRef<VarBinding> Bindings,
+                            ExprAST *Body) {
+            ID.AddInteger(EK_Var);
+            for (const VarBinding &B : Bindings) {
+                ID.AddInteger(B.Name);
+                ID.AddPointer(B.Init);
+            }
+            ID.AddPointer(Body);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
+};
+
+// IndexExprAST - Expression class for an element of an array, like "a[i]".
+// On the left of an '=' it is stored to rather than loaded.
+class IndexExprAST : public ExprAST {
+    SymbolID Array;
+    ExprAST *Index;
+
+    public: 
+        IndexExprAST(SymbolID Array, ExprAST *Index)
+            : ExprAST(EK_Index), Array(Array), Index(Index) {}
+        SymbolID getArray() const { return Array; }
+        ExprAST *getIndex() const { return Index; }
+        Value *codegen(CompilerSession &S, Value *IndexV);
+
+        static void Profile(FoldingSetNodeID &ID, SymbolID Array, ExprAST *Index) {
+            ID.AddInteger(EK_Index);
+            ID.AddInteger(Array);
+            ID.AddPointer(Index);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_Index; }
+};
+
+// ParForExprAST - Expression class for parfor/in. The iterations run on as
+// many threads as there are, and Op is what their values are reduced with:
+// '+' or '*', or 0 if the loop has no reduce and they are ignored.
+class ParForExprAST : public ExprAST {
+    SymbolID VarName;
+    char Op;
+    ExprAST *Start, *End, *Body;
+
+    public: 
+        ParForExprAST(SymbolID VarName, char Op, ExprAST *Start, ExprAST *End,
+                      ExprAST *Body)
+            : ExprAST(EK_ParFor), VarName(VarName), Op(Op), Start(Start),
+              End(End), Body(Body) {}
+        SymbolID getVarName() const { return VarName; }
+        char getOp() const { return Op; }
+        ExprAST *getStart() const { return Start; }
+        ExprAST *getEnd() const { return End; }
+        ExprAST *getBody() const { return Body; }
+        Value *codegen(CompilerSession &S, Value *StartV, Value *EndV);
+
+        static void Profile(FoldingSetNodeID &ID, SymbolID VarName, char Op,
+                            ExprAST *Start, ExprAST *End, ExprAST *Body) {
+            ID.AddInteger(EK_ParFor);
+            ID.AddInteger(VarName);
+            ID.AddInteger(Op);
+            ID.AddPointer(Start);
+            ID.AddPointer(End);
+            ID.AddPointer(Body);
+        }
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_ParFor; }
+};
+
+template <typename FnT> void ExprAST::forEachOperand(FnT F) const {
+    switch (Kind) {
+        case EK_Number:
+        case EK_Variable:
+            return;
+        case EK_Binary:
+            F(cast<BinaryExprAST>(this)->getLHS());
+            F(cast<BinaryExprAST>(this)->getRHS());
+            return;
+        case EK_Call:
+            for (ExprAST *Arg : cast<CallExprAST>(this)->getArgs())
+                F(Arg);
+            return;
+        case EK_If: {
+            auto *I = cast<IfExprAST>(this);
+            F(I->getCond());
+            F(I->getThen());
+            F(I->getElse());
+            return;
+        }
+        case EK_For: {
+            auto *L = cast<ForExprAST>(this);
+            F(L->getStart());
+            F(L->getEnd());
+            if (L->getStep())
+                F(L->getStep());
+            F(L->getBody());
+            return;
+        }
+        case EK_Var: {
+            auto *V = cast<VarExprAST>(this);
+            for (const VarBinding &B : V->getBindings())
+                if (B.Init)
+                    F(B.Init);
+            F(V->getBody());
+            return;
+        }
+        case EK_Index:
+            F(cast<IndexExprAST>(this)->getIndex());
+            return;
+        case EK_ParFor: {
+            auto *L = cast<ParForExprAST>(this);
+            F(L->getStart());
+            F(L->getEnd());
+            F(L->getBody());
+            return;
+        }
+    }
+}
+
+void ExprAST::Profile(FoldingSetNodeID &ID) const {
+    switch (Kind) {
+        case EK_Number:
+            return NumberExprAST::Profile(ID, cast<NumberExprAST>(this)->getVal());
+        case EK_Variable:
+            return VariableExprAST::Profile(ID, cast<VariableExprAST>(this)->getName());
+        case EK_Binary: {
+            auto *B = cast<BinaryExprAST>(this);
+            return BinaryExprAST::Profile(ID, B->getOp(), B->getLHS(), B->getRHS());
+        }
+        case EK_Call: {
+            auto *C = cast<CallExprAST>(this);
+            return CallExprAST::Profile(ID, C->getCallee(), C->getArgs());
+        }
+        case EK_If: {
+            auto *I = cast<IfExprAST>(this);
+            return IfExprAST::Profile(ID, I->getCond(), I->getThen(), I->getElse());
+        }
+        case EK_For: {
+            auto *L = cast<ForExprAST>(this);
+            return ForExprAST::Profile(ID, L->getVarName(), L->getStart(),
+                                       L->getEnd(), L->getStep(), L->getBody());
+        }
+        case EK_Var: {
+            auto *V = cast<VarExprAST>(this);
+            return VarExprAST::Profile(ID, V->getBindings(), V->getBody());
+        }
+        case EK_Index: {
+            auto *I = cast<IndexExprAST>(this);
+            return IndexExprAST::Profile(ID, I->getArray(), I->getIndex());
+        }
+        case EK_ParFor: {
+            auto *L = cast<ParForExprAST>(this);
+            return ParForExprAST::Profile(ID, L->getVarName(), L->getOp(),
+                                          L->getStart(), L->getEnd(), L->getBody());
+        }
+    }
+}
+
+// ASTContext - Allocates expression nodes, and hash-conses them: asking for a
+// node equal to one that already exists, same kind, same fields and the very
+// same operand nodes, gives back the existing one. Built bottom up, every
+// repeated subexpression of an item ends up as a single node.
+//
+// Calls and assignments are the exception. Only a call to a function known
+// to be pure may stand for every other call like it; a call to an extern, or
+// to anything else that might have side effects, always gets a node of its
+// own, and so does every assignment.
+//
+// A node with one of those among its operands is new itself, and so never
+// shared either.
+class ASTContext {
+    BumpPtrAllocator Arena;
+    FoldingSet<ExprAST> UniqueNodes;
+
+    template <typename NodeT, typename... ArgTs>
+    NodeT *getOrCreate(ArgTs... Args) {
+        FoldingSetNodeID ID;
+        NodeT::Profile(ID, Args...);
+        void *InsertPos;
+        if (ExprAST *E = UniqueNodes.FindNodeOrInsertPos(ID, InsertPos))
+            return cast<NodeT>(E);
+        auto *N = new (Arena) NodeT(Args...);
+        UniqueNodes.InsertNode(N, InsertPos);
+        return N;
+    }
+
+    public: 
+        NumberExprAST *getNumber(double Val) {
+            return getOrCreate<NumberExprAST>(Val);
+        }
+        VariableExprAST *getVariable(SymbolID Name) {
+            return getOrCreate<VariableExprAST>(Name);
+        }
+        BinaryExprAST *getBinary(char Op, ExprAST *LHS, ExprAST *RHS) {
+            if (Op == '=')
+                return new (Arena) BinaryExprAST(Op, LHS, RHS);
+            return getOrCreate<BinaryExprAST>(Op, LHS, RHS);
+        }
+        CallExprAST *getCall(SymbolID Callee, ArrayRef<ExprAST *> Args, bool Pure) {
+            if (!Pure)
+                return CallExprAST::Create(Arena, Callee, Args, false);
+            FoldingSetNodeID ID;
+            CallExprAST::Profile(ID, Callee, Args);
+            void *InsertPos;
+            if (ExprAST *E = UniqueNodes.FindNodeOrInsertPos(ID, InsertPos))
+                return cast<CallExprAST>(E);
+            CallExprAST *C = CallExprAST::Create(Arena, Callee, Args, true);
+            UniqueNodes.InsertNode(C, InsertPos);
+            return C;
+        }
+        IfExprAST *getIf(ExprAST *Cond, ExprAST *Then, ExprAST *Else) {
+            return getOrCreate<IfExprAST>(Cond, Then, Else);
+        }
+        ForExprAST *getFor(SymbolID VarName, ExprAST *Start, ExprAST *End,
+                           ExprAST *Step, ExprAST *Body) {
+            return getOrCreate<ForExprAST>(VarName, Start, End, Step, Body);
+        }
+        VarExprAST *getVar(ArrayRef<VarBinding> Bindings, ExprAST *Body) {
+            FoldingSetNodeID ID;
+            VarExprAST::Profile(ID, Bindings, Body);
+            void *InsertPos;
+            if (ExprAST *E = UniqueNodes.FindNodeOrInsertPos(ID, InsertPos))
+                return cast<VarExprAST>(E);
+            VarExprAST *V = VarExprAST::Create(Arena, Bindings, Body);
+            UniqueNodes.InsertNode(V, InsertPos);
+            return V;
+        }
+        IndexExprAST *getIndex(SymbolID Array, ExprAST *Index) {
+            return getOrCreate<IndexExprAST>(Array, Index);
+        }
+        ParForExprAST *getParFor(SymbolID VarName, char Op, ExprAST *Start,
+                                 ExprAST *End, ExprAST *Body) {
+            return getOrCreate<ParForExprAST>(VarName, Op, Start, End, Body);
+        }
+
+        // drop every node at once
+        void Reset() {
+            UniqueNodes.clear();
+            Arena.Reset();
+        }
 };
 
 class PrototypeAST {
-    std::string Name; 
-    std::vector<std::string> Args; 
+    SymbolID Name;
+    std::vector<SymbolID> Args;
+    std::vector<bool> IsArray; // for each argument, whether it is an array
 
     public: 
-        PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-            : Name(Name), Args(std::move(Args)) {}
-        const std::string &getName() const { return Name; }
-        Function *codegen();
+        PrototypeAST(SymbolID Name, std::vector<SymbolID> Args,
+                     std::vector<bool> IsArray = {})
+            : Name(Name), Args(std::move(Args)), IsArray(std::move(IsArray)) {
+            this->IsArray.resize(this->Args.size());
+        }
+        SymbolID getName() const { return Name; }
+        ArrayRef<SymbolID> getArgs() const { return Args; }
+        bool isArrayArg(unsigned I) const { return IsArray[I]; }
+        bool hasSameSignature(const PrototypeAST &RHS) const {
+            return IsArray == RHS.IsArray;
+        }
+        Function *codegen(CompilerSession &S);
+};
+
+// FPMode - How freely the floating point arithmetic of a function may be
+// rearranged: not at all, by fusing a multiply and an add into one rounding,
+// or as if it were real numbers. FP_Session is the mode of the session, which
+// is what -fp-mode says unless its host sets another.
+enum FPMode : uint8_t { FP_Session, FP_Strict, FP_Contract, FP_Fast };
+
+// HostArray - An array of doubles that belongs to the host. Scripts see each
+// one as a variable that is always in scope, under the name it was added
+// with; its elements can be read and stored, but it cannot grow or shrink.
+struct HostArray {
+    double *Data;
+    int64_t Len;
 };
 
 // FunctionAST - This class represents a function definition itself 
 class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto; 
-    std::unique_ptr<ExprAST> Body; 
+    ExprAST *Body;
+    bool Memo; // results are cached, as in "memo def"
+    FPMode Precision; // as in "precision(fast) def"
 
     public:
-        FunctionAST(std::unique_ptr<PrototypeAST> Proto, 
-                std::unique_ptr<ExprAST> Body)
-            : Proto(std::move(Proto)), Body(std::move(Body)) {}
-        Function *codegen();
+        FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body,
+                    bool Memo = false, FPMode Precision = FP_Session)
+            : Proto(std::move(Proto)), Body(Body), Memo(Memo), Precision(Precision) {}
+        SymbolID getName() const { return Proto->getName(); }
+        const PrototypeAST &getProto() const { return *Proto; }
+        ExprAST *getBody() const { return Body; }
+        bool isMemo() const { return Memo; }
+        FPMode getPrecision() const { return Precision; }
+        void simplify(ASTContext &AST);
+        Function *codegen(CompilerSession &S);
 };
 
-// parser
-    
-static int CurTok; 
-static int getNextToken() {
-    return CurTok = gettok();
-}
+// PendingExpr - A top-level expression of a compilation unit, to be run once
+// the program is linked: either an anon function to call, or a value already
+// known at compile time
+struct PendingExpr {
+    std::string Name;
+    bool IsConstant;
+    double Value;
+};
 
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-    fprintf(stderr, "Error: %s\n", Str); 
-    return nullptr; 
-}
+// TokenRecord - A token as the parser consumed it. Whitespace and comments
+// are already gone and identifiers are interned, so two runs of source text
+// give equal records exactly when they parse the same.
+struct TokenRecord {
+    int Tok;
+    SymbolID Sym; // only for tok_identifier
+    double Num;   // only for tok_number
 
-std::unique_ptr<PrototypeAST> LogErrorP (const char *Str) {
-    LogError(Str); 
-    return nullptr;
-}
+    bool operator==(const TokenRecord &RHS) const {
+        return Tok == RHS.Tok && Sym == RHS.Sym && Num == RHS.Num;
+    }
+    bool operator!=(const TokenRecord &RHS) const { return !(*this == RHS); }
+};
 
-// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
-    getNextToken(); // consume the number
-    return std::move(Result);
-}
+// CompilerSession - Owns everything one lexer/parser/codegen/JIT pipeline
+// needs. Nothing in here is shared, so independent sessions can run side by
+// side on separate threads of the same process. The one exception is the JIT
+// itself, which the compilation units of a multi-script program share.
+class CompilerSession {
+    // lexer state
+    FILE *In = nullptr;                // interactive source, read a line at a time
+    std::unique_ptr<MemoryBuffer> Buf; // batch source, mapped in whole
+    std::string Line;                  // the current interactive line
+    const char *CurPtr = nullptr, *BufEnd = nullptr;
+    bool Interactive = false;
+    SymbolID IdentifierSym;  // filled in if tok_identifier
+    double NumVal;           // filled in if tok_number
 
-// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-    getNextToken(); // Eat '('
-    auto V = ParseExpression(); 
-    if (!V)
-        return nullptr;
+    // parser state
+    int CurTok;
+    // binopPrecedence - This holds the precedence for each binary operator that is defined,
+    // indexed by the operator character; 0 means not a binop
+    int BinopPrecedence[256] = {};
+    // every node of the top-level item being parsed, or of the batch of
+    // top-level expressions being collected
+    ASTContext AST;
+    // cleared when the item being parsed calls something not known to be pure
+    bool ItemIsPure;
+    // tokens already lexed that the parser is to see again, from ReplayPos on
+    std::vector<TokenRecord> Replay;
+    size_t ReplayPos = 0;
+    // while set, getNextToken appends each token it consumes to Recorded
+    bool RecordTokens = false;
+    std::vector<TokenRecord> Recorded;
+    // the tokens of every compiled definition, by function name, so that an
+    // unchanged definition sent again (say, a prelude the client resends on
+    // every connection) costs a token comparison rather than a recompile
+    DenseMap<SymbolID, std::vector<TokenRecord>> DefinitionTokens;
 
-    if (CurTok != ')')
-        return LogError("expected ')'");
-    getNextToken();     // eat ')'
-    return V;
+    // Set when compiling one unit of a multi-script program: items are only
+    // code generated into TheModule, which the caller links and runs once all
+    // the units are done.
+    bool CompileOnly = false;
+    unsigned UnitID = 0;
+    std::string UnitName;                  // prefixes diagnostics
+    std::vector<PendingExpr> PendingExprs; // top-level expressions to run
+
+    // set while precompiling: items are written out rather than generated
+    KBCWriter *Writer = nullptr;
+
+    // Definitions go to the JIT in chunks of up to -def-batch, each under a
+    // ResourceTracker of its own, so that a chunk nothing calls any more can
+    // be evicted again as a whole
+    struct DefinitionChunk {
+        ResourceTrackerSP RT;
+        std::vector<SymbolID> Defs;
+        uint64_t LastUse; // the last item that added or called one of Defs
+    };
+    std::vector<SymbolID> PendingDefs; // generated into TheModule, not yet added
+    std::list<DefinitionChunk> Chunks;
+    DenseMap<SymbolID, std::list<DefinitionChunk>::iterator> ChunkOf;
+    // the functions each definition in the JIT calls, and for each, how many
+    // definitions in other chunks call it
+    DenseMap<SymbolID, std::vector<SymbolID>> Callees;
+    DenseMap<SymbolID, unsigned> ExternalCallers;
+    // the optimized IR of the small definitions in the JIT, by function
+    // name, each as the bitcode of a module of its own: modules have
+    // contexts of their own, so it cannot be shared as it is
+    StringMap<SmallVector<char, 0>> RetainedIR;
+    uint64_t ItemCount = 0; // items handled so far
+    // how freely the arithmetic of definitions that do not say may be
+    // rearranged, see setFPMode
+    FPMode SessionPrecision;
+    // the first index out of bounds that the code run since the last
+    // reportBoundsError ran into; parfor loops run code on other threads
+    std::mutex BoundsMutex;
+    bool HasBoundsError = false;
+    double BoundsIndex;
+    int64_t BoundsLen;
+
+    // A script's top-level expressions are code generated together, for as
+    // long as they are pure and run straight on, into one function that
+    // stores the value of the Nth to Out[N]. Like the nodes of one expression,
+    // subexpressions repeated across the batch are then only generated once.
+    Function *BatchFn = nullptr;
+    unsigned BatchSize = 0;
+    // where the code of the expressions in the batch ends: its last block,
+    // the size of that, and the number of blocks up to it
+    BasicBlock *BatchEnd = nullptr;
+    size_t BatchEndSize = 0;
+    unsigned BatchBlocks = 0;
+
+    public: 
+        // every identifier the session has seen
+        SymbolTable Symbols;
+
+        // code generation state, used by the AST nodes' codegen()
+        std::unique_ptr<LLVMContext> TheContext;
+        std::unique_ptr<Module> TheModule;
+        std::unique_ptr<IRBuilder<>> Builder;
+        // the stack slot of every variable in scope, promoted to registers
+        // by SROA
+        DenseMap<SymbolID, AllocaInst *> NamedValues;
+        std::shared_ptr<KaleidoscopeJIT> TheJIT;
+        // what the loop passes ask about the target: vector widths, costs
+        std::unique_ptr<TargetMachine> TM;
+        std::unique_ptr<FunctionPassManager> TheFPM;
+        std::unique_ptr<LoopAnalysisManager> TheLAM;
+        std::unique_ptr<FunctionAnalysisManager> TheFAM;
+        std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
+        std::unique_ptr<ModuleAnalysisManager> TheMAM;
+        std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
+        std::unique_ptr<StandardInstrumentations> TheSI;
+        DenseMap<SymbolID, std::unique_ptr<PrototypeAST>> FunctionProtos;
+        // the functions from FunctionProtos that have a body, not just an
+        // extern declaration
+        DenseSet<SymbolID> DefinedFunctions;
+        // the defined functions whose calls may be shared: their bodies only
+        // call other pure functions, so they have no side effects
+        DenseSet<SymbolID> PureFunctions;
+        // the externs for C math functions, each with the intrinsic its
+        // calls are generated as
+        DenseMap<SymbolID, Intrinsic::ID> MathExterns;
+        // the host's arrays, by the name scripts know each as
+        StringMap<HostArray> HostArrays;
+        // What a call can assume of the function it calls, from what its
+        // body does or its extern says, as the LLVM attributes of its
+        // declarations. Every function is nounwind: nothing throws.
+        enum FunctionInfo : unsigned {
+            FI_ReadNone = 1,   // no memory a caller can see
+            FI_ReadOnly = 2,   // reads arrays, but stores to none
+            FI_WillReturn = 4, // no loops, recursion or bounds errors
+            FI_NoFree = 8,     // frees no memory
+        };
+        DenseMap<SymbolID, unsigned> FunctionInfos;
+        unsigned inferFunctionInfo(ExprAST *Body, SymbolID Self) const;
+        void addFunctionAttrs(Function *F, unsigned Info);
+        // ValueScope - The value generated for each node of the function
+        // being generated, so a node with several parents is only emitted
+        // once. Each branch of an if, each loop body and each var gets a
+        // scope of its own, since what is generated inside does not dominate
+        // the code after it. A scope that rebinds a variable already in
+        // NamedValues is a barrier: values from outside it may have been
+        // computed from the old binding, so lookups do not go past it. So is
+        // a loop body, where values from before the loop may be stale from
+        // the second time round.
+        //
+        // An assignment may make any value read from a variable stale, so it
+        // empties every scope.
+        struct ValueScope {
+            DenseMap<const ExprAST *, Value *> Values;
+            bool Barrier = false;
+            // the bindings the scope replaced, restored when it is popped
+            SmallVector<std::pair<SymbolID, AllocaInst *>, 1> Shadowed;
+        };
+        SmallVector<ValueScope, 4> ValueScopes;
+
+        Value *lookupEmitted(const ExprAST *E) const {
+            for (const ValueScope &Scope : reverse(ValueScopes)) {
+                if (Value *V = Scope.Values.lookup(E))
+                    return V;
+                if (Scope.Barrier)
+                    break;
+            }
+            return nullptr;
+        }
+        void setEmitted(const ExprAST *E, Value *V) { ValueScopes.back().Values[E] = V; }
+        // start over with a single, empty scope for a new function
+        void resetValueScopes() {
+            ValueScopes.clear();
+            ValueScopes.emplace_back();
+        }
+        void pushValueScope(bool Barrier = false) {
+            ValueScopes.emplace_back();
+            ValueScopes.back().Barrier = Barrier;
+        }
+        // bindInScope - Bind Var to A for as long as the innermost scope lasts
+        void bindInScope(SymbolID Var, AllocaInst *A);
+        void popValueScope();
+        // forgetEmitted - Drop every value emitted so far, after an assignment
+        void forgetEmitted() {
+            for (ValueScope &Scope : ValueScopes)
+                Scope.Values.clear();
+        }
+
+        // Values are typed: double, i64 for integers, i1 for the results
+        // of comparisons, and <4 x double> or <8 x double> for vectors. Each
+        // is converted only where a use needs another type, so comparisons
+        // feed branches directly and integer code never goes near the FPU. A
+        // number mixed with a vector goes into every lane; a vector never
+        // turns back into a number but through a builtin. An array is an
+        // {ptr, i64} of its elements and length, and converts to nothing
+        // else.
+        Value *getConstant(double Val);
+        // joinTypes - The narrowest type that holds the values of both A and
+        // B, or null for vectors of different widths or an array and anything
+        // else
+        Type *joinTypes(Type *A, Type *B);
+        // convertTo - V as a Ty, or null with an error logged if a Ty cannot
+        // hold it
+        Value *convertTo(Value *V, Type *Ty);
+        // emitArith - Emit L Op R for one of + - *, in integers if both are
+        // integers and lane by lane if either is a vector
+        Value *emitArith(char Op, Value *L, Value *R, const Twine &Name);
+        StructType *getArrayType();
+        // loadVariable - The value of the variable or host array Name
+        Value *loadVariable(SymbolID Name);
+        // emitElementAddress - Check Index against the bounds of Array and
+        // give the address of that element
+        Value *emitElementAddress(Value *Array, Value *Index);
+        // A function takes each array argument as two, the pointer and the
+        // length, so the host can call it with a double * and an int64_t.
+        FunctionType *getFunctionType(const PrototypeAST &P, Type *ArgTy, Type *RetTy);
+        void nameArgs(Function *F, const PrototypeAST &P);
+
+        // A variable's stack slot takes the type of its first value. When a
+        // later assignment needs a wider one, the function body is generated
+        // again with the slot widened; the slots are told apart by the node
+        // that binds them (null for the arguments) and their index in it.
+        using SlotKey = std::pair<const ExprAST *, unsigned>;
+        DenseMap<SlotKey, Type *> SlotTypes;
+        DenseMap<AllocaInst *, SlotKey> SlotOf;
+        bool NeedsRetry = false;
+        AllocaInst *createSlot(const ExprAST *Owner, unsigned Index,
+                               StringRef Name, Type *Ty);
+        bool storeToSlot(Value *V, AllocaInst *Slot);
+        Value *emitFunctionBody(Function *F, const PrototypeAST &P, ExprAST *Body);
+        // the calls in tail position in the body being generated, which are
+        // generated as tail calls
+        DenseSet<const ExprAST *> TailCalls;
+        void findTailCalls(ExprAST *Body);
+        // deleteFunctionBody - Delete the body of F, and with it the bodies of
+        // the parfor loops outlined from it, which nothing else calls
+        void deleteFunctionBody(Function *F);
+        Function *emitParForBody(const ParForExprAST &L, Type *VarTy,
+                                 StructType *CtxTy, ArrayRef<SymbolID> Captures);
+
+        // the return type of every function with an integer specialization,
+        // as the width of the integer it returns or 0 for a double: types
+        // belong to a context, and this outlives each module's
+        DenseMap<SymbolID, unsigned> IntSpecializations;
+        Function *getSpecialization(SymbolID Name);
+        Function *emitSpecialization(const PrototypeAST &P, ExprAST *Body);
+        void emitMemoCache(Function *F, Function *BodyF);
+
+        CompilerSession(std::shared_ptr<KaleidoscopeJIT> TheJIT);
+        ~CompilerSession();
+
+        // Create - Set up a session with a JIT of its own
+        static Expected<std::unique_ptr<CompilerSession>> Create();
+
+        // setFPMode - Generate the definitions that do not say how freely
+        // their arithmetic may be rearranged, and top-level expressions, in
+        // Mode from now on. What is generated already keeps its mode.
+        void setFPMode(FPMode Mode);
+        // getFastMathFlags - The flags of the floating point operations of a
+        // function generated in Mode
+        FastMathFlags getFastMathFlags(FPMode Mode) const;
+
+        // addHostArray - Hand Data[0..Len) to the session's scripts as the
+        // array Name. Arrays have to be added before code that uses them is
+        // generated, and outlive the session.
+        void addHostArray(StringRef Name, double *Data, int64_t Len);
+        // recordBoundsError - Keep the first index out of bounds that the
+        // generated code runs into, from whichever thread, until it is
+        // reported
+        void recordBoundsError(double Index, int64_t Len);
+        // reportBoundsError - Report the index out of bounds kept since the
+        // last call, if there is one; true if there was
+        bool reportBoundsError();
+
+        // run the main "interpretter loop" over interactive input until In
+        // is exhausted
+        void run(FILE *In);
+
+        // run the main loop over a whole script, lexed in place from Src, or
+        // the items of Src as they are if it is a precompiled script
+        void run(std::unique_ptr<MemoryBuffer> Src);
+
+        // emitKBC - Parse the script Src and write it to OS as a precompiled
+        // script, without generating or running any code
+        void emitKBC(std::unique_ptr<MemoryBuffer> Src, raw_ostream &OS);
+
+        // compile - Code generate Src as unit UnitID of a larger program,
+        // without running anything. Definitions and top-level expressions all
+        // end up in one module for the caller to link.
+        void compile(std::unique_ptr<MemoryBuffer> Src, unsigned UnitID);
+        ThreadSafeModule takeModule();
+        ArrayRef<PendingExpr> getPendingExprs() const { return PendingExprs; }
+        StringRef getUnitName() const { return UnitName; }
+
+        // getFunction - Find Name in the module being generated, declaring it
+        // there if an earlier item defined or declared it
+        Function *getFunction(SymbolID Name);
+
+        // error reporting, each returns null for the caller to pass up
+        ExprAST *LogError(const char *Str);
+        std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
+        Value *LogErrorV(const char *Str);
+
+    private:
+        // lexer
+        bool refill();
+        int gettok();
+
+        // parser
+        TokenRecord currentToken() const;
+        int getNextToken();
+        int GetTokPrecedence();
+        ExprAST *ParseNumberExpr();
+        ExprAST *ParsePrimary();
+        ExprAST *ParseExpression();
+        std::unique_ptr<PrototypeAST> ParsePrototype();
+        std::unique_ptr<FunctionAST> ParseDefinition();
+        std::unique_ptr<PrototypeAST> ParseExtern(bool &Pure);
+        std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+        std::unique_ptr<FunctionAST> makeTopLevelFunction(ExprAST *E);
+
+        // top-level driver
+        void InitializeModuleAndManagers();
+        bool skipUnchangedDefinition();
+        void HandleDefinition();
+        void HandleExtern();
+        void HandleTopLevelExpression();
+        // what becomes of an item once parsed, or loaded from a .kbc file
+        bool compileDefinition(std::unique_ptr<FunctionAST> FnAST);
+        bool callsOnlyPure(ExprAST *Body, SymbolID Self) const;
+        void compileExtern(std::unique_ptr<PrototypeAST> ProtoAST, bool Pure);
+        void compileTopLevelExpr(std::unique_ptr<FunctionAST> FnAST);
+        void touchCallees(ExprAST *E);
+        void retainIR(Function *F);
+        void inlineEarlierDefinitions();
+        void flushDefinitions();
+        void evictDefinitions();
+        void evictChunk(std::list<DefinitionChunk>::iterator C);
+        void finishItem();
+        bool canBatch(ExprAST *E);
+        void addToBatch(ExprAST *E);
+        void flushBatch();
+        void MainLoop();
+        void runKBC(MemoryBufferRef Src);
+};
+
+// lexer
+
+// refill - Called when CurPtr reaches BufEnd. A mapped script is complete
+// already; interactive input is pulled in a line at a time so the REPL still
+// answers each line as soon as it is typed. Tokens never span lines, so
+// nothing in flight points into the line being replaced.
+bool CompilerSession::refill() {
+    if (!In)
+        return false;
+    Line.clear();
+    char Chunk[4096];
+    while (fgets(Chunk, sizeof(Chunk), In)) {
+        Line += Chunk;
+        if (Line.back() == '\n')
+            break;
+    }
+    CurPtr = Line.data();
+    BufEnd = CurPtr + Line.size();
+    return !Line.empty();
 }
 
+int CompilerSession::gettok() {
+    while (true) {
+        // skip any whitespace
+        CurPtr = skipSpace(CurPtr, BufEnd);
+        if (CurPtr == BufEnd) {
+            // check for end of file
+            if (!refill())
+                return tok_eof;
+            continue;
+        }
+
+        const char *TokStart = CurPtr;
+        unsigned char C = *CurPtr++;
 
-// identifierexpr
-//      ::= identifier
-//      ::= identifer '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr; 
+        // identifier: [a-zA-Z][a-zA-Z0-9]*
+        if (isAlphaChar(C)) {
+            CurPtr = skipAlnum(CurPtr, BufEnd);
+            IdentifierSym = Symbols.intern(StringRef(TokStart, CurPtr - TokStart));
 
-    getNextToken();     // eat identifier
+            if (IdentifierSym < num_keywords)
+                return KeywordTokens[IdentifierSym];
+            return tok_identifier;
+        }
+        // number: [0-9.]+
+        if (isDigitChar(C) || C == '.') {
+            // not really correct, accepts [0-9].[0-9].[0-9.]
+            while (CurPtr != BufEnd && (isDigitChar(*CurPtr) || *CurPtr == '.'))
+                ++CurPtr;
 
-    if (CurTok != '(')
-        return std::make_unique<VariableExprAST>(IdName); 
+            // like strtod, take the longest prefix that is a valid number
+            if (std::from_chars(TokStart, CurPtr, NumVal).ec != std::errc())
+                NumVal = 0;
+            return tok_number;
+        }
+        // comment until end of line
+        if (C == '#') {
+            CurPtr = skipToEOL(CurPtr, BufEnd);
+            continue;
+        }
 
-    // call
-    getNextToken();     // eat '('
-    std::vector<std::unique_ptr<ExprAST>> Args; 
-    if (CurTok != ')') {
-        while (true) {
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg)); 
-            else 
-                return nullptr; 
-            if (CurTok == ')')
-                break;
+        // Otherwise, just return the character as it its ascii value
+        return C;
+    }
+}
+
+// parser
 
-            if (CurTok != ',')
-                return LogError("Expected ')' or ',' in argument list"); 
-            getNextToken(); 
+TokenRecord CompilerSession::currentToken() const {
+    return {CurTok, CurTok == tok_identifier ? IdentifierSym : 0,
+            CurTok == tok_number ? NumVal : 0.0};
+}
+
+int CompilerSession::getNextToken() {
+    if (RecordTokens)
+        Recorded.push_back(currentToken());
+    if (ReplayPos < Replay.size()) {
+        const TokenRecord &T = Replay[ReplayPos++];
+        IdentifierSym = T.Sym;
+        NumVal = T.Num;
+        CurTok = T.Tok;
+        if (ReplayPos == Replay.size()) {
+            Replay.clear();
+            ReplayPos = 0;
         }
+        return CurTok;
     }
+    return CurTok = gettok();
+}
 
-    // Eat the ')'
-    getNextToken(); 
+ExprAST *CompilerSession::LogError(const char *Str) {
+    // the body is generated again anyway, and the error may only be down to
+    // a slot that is too narrow, say a vector held in a number's slot
+    if (NeedsRetry)
+        return nullptr;
+    // the results of the expressions before this one come first
+    flushBatch();
+    if (!UnitName.empty())
+        fprintf(stderr, "%s: ", UnitName.c_str());
+    fprintf(stderr, "Error: %s\n", Str); 
+    return nullptr; 
+}
 
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+std::unique_ptr<PrototypeAST> CompilerSession::LogErrorP(const char *Str) {
+    LogError(Str); 
+    return nullptr;
 }
 
+// numberexpr ::= number
+ExprAST *CompilerSession::ParseNumberExpr() {
+    auto Result = AST.getNumber(NumVal);
+    getNextToken(); // consume the number
+    return Result;
+}
 
-// primary 
-//      ::= identifierexpr
+// primary
 //      ::= numberexpr
-//      ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
+ExprAST *CompilerSession::ParsePrimary() {
     switch(CurTok) {
         default:
             return LogError("unknown token when expecting an expression");
-        case tok_identifier:
-            return ParseIdentifierExpr(); 
         case tok_number:
             return ParseNumberExpr(); 
-        case '(':
-            return ParseParenExpr();
     }
 }
 
-// binopPrecedence - This holds the precedence for each binary operator that is defined
-static std::map<char, int> BinopPrecedence; 
-
 // GetTokPrecedence - Get The precedence of the pending binary operator token
-static int GetTokPrecedence() {
-    if (!isascii(CurTok))
+int CompilerSession::GetTokPrecedence() {
+    if ((unsigned)CurTok >= std::size(BinopPrecedence))
         return -1;
 
     // Make sure it's a declared binop
@@ -286,231 +1332,2844 @@ static int GetTokPrecedence() {
     if (TokPrec <= 0) return -1;
     return TokPrec;
 }
-    
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS) {
-    
-    // if this is a binop, find its precedence 
-    while (true) {
-        int TokPrec = GetTokPrecedence(); 
+// expression
+//      ::= operand (binop operand)*
+// operand
+//      ::= primary
+//      ::= identifier
+//      ::= identifier '(' (expression (',' expression)*)? ')'
+//      ::= identifier '[' expression ']'
+//      ::= '(' expression ')'
+//      ::= 'if' expression 'then' expression 'else' expression
+//      ::= 'for' identifier '=' expression ',' expression (',' expression)?
+//              'in' expression
+//      ::= 'var' identifier ('=' expression)?
+//              (',' identifier ('=' expression)?)* 'in' expression
+//      ::= 'parfor' identifier '=' expression ',' expression
+//              ('reduce' '(' ('+' | '*') ')')? 'in' expression
+//
+// Parsed with an explicit operator stack rather than by recursive descent, so
+// neither long operator chains nor deeply nested parentheses, calls, ifs and
+// loops use any more native stack. Besides pending binary operators the stack
+// holds a marker for every open '(', call, if, for, parfor and var, recording
+// which of its parts is being parsed; operands collect on a second stack. The
+// last part of an if, a loop or a var, like a whole expression, runs on for as
+// long as there are binary operators to continue it.
+//
+// The variables of a var go on the operand stack too, each as a variable
+// node followed by its initializer, or null if it has none.
+ExprAST *CompilerSession::ParseExpression() {
+    struct PendingOp {
+        enum {
+            Binary, Paren, Call, Index,
+            IfCond, IfThen, IfElse,
+            ForStart, ForEnd, ForStep, ForBody,
+            ParForStart, ParForEnd, ParForBody,
+            VarInit, VarBody,
+        } Kind;
+        int Op;                // Binary: the operator token, ParForBody: the
+                               // reduce operator, or 0
+        int Prec;              // Binary: its precedence
+        SymbolID Name;         // Call: the function being called, Index: the array,
+                               // For*, ParFor*: the variable
+        unsigned OperandsBase; // Call, If*, For*, ParFor*, Var*: index of its first
+                               // operand on Operands
+    };
+    SmallVector<PendingOp, 16> Ops;
+    SmallVector<ExprAST *, 16> Operands;
 
-        // if this is a binop that binds at least as tightly as the current binop, 
-        // consume it, otherwise we are done
-        if (TokPrec < ExprPrec)
-            return LHS; 
+    // Parse the bindings of the var on top of Ops, from its first one if
+    // First is set and from the end of an initializer if not, up to the next
+    // expression to parse: an initializer, or the body after 'in'
+    auto ParseVarBindings = [&](bool First) -> bool {
+        PendingOp &Open = Ops.back();
+        while (true) {
+            if (!First) {
+                if (CurTok == tok_in) {
+                    getNextToken(); // eat the in
+                    Open.Kind = PendingOp::VarBody;
+                    return true;
+                }
+                if (CurTok != ',') {
+                    LogError("expected 'in' keyword after 'var'");
+                    return false;
+                }
+                getNextToken(); // eat ','
+            }
+            First = false;
 
-        // Okay, we know this is a binop 
-        int BinOp = CurTok; 
-        getNextToken();  // eat binop 
+            if (CurTok != tok_identifier) {
+                LogError("expected identifier after var");
+                return false;
+            }
+            Operands.push_back(AST.getVariable(IdentifierSym));
+            getNextToken(); // eat identifier
+            if (CurTok == '=') {
+                getNextToken(); // eat '='
+                Open.Kind = PendingOp::VarInit;
+                return true;
+            }
+            Operands.push_back(nullptr); // no initializer
+        }
+    };
 
-        // Parse the primary expression after the binary operator
-        auto RHS = ParsePrimary();
-        if (!RHS)
-            return nullptr;
+    // Combine binary operators from the top of the stack for as long as they
+    // bind at least as tightly as MinPrec (so equal precedence associates to
+    // the left), stopping at the innermost open marker.
+    auto Reduce = [&](int MinPrec) {
+        while (!Ops.empty() && Ops.back().Kind == PendingOp::Binary &&
+               Ops.back().Prec >= MinPrec) {
+            ExprAST *RHS = Operands.pop_back_val();
+            ExprAST *LHS = Operands.pop_back_val();
+            Operands.push_back(AST.getBinary(Ops.back().Op, LHS, RHS));
+            Ops.pop_back();
+        }
+    };
 
-        // If BinOp binds less tightly with RHS than the operator after RHS, let 
-        // the pending operator take RHS at its LHS
-        int NextPrec = GetTokPrecedence(); 
-        if (TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS)); 
-            if (!RHS)
+    while (true) {
+        // expecting an operand
+        if (CurTok == '(') {
+            getNextToken(); // eat '('
+            Ops.push_back({PendingOp::Paren, 0, 0, 0, 0});
+            continue;
+        }
+        if (CurTok == tok_if) {
+            getNextToken(); // eat the if
+            Ops.push_back({PendingOp::IfCond, 0, 0, 0, (unsigned)Operands.size()});
+            continue;
+        }
+        if (CurTok == tok_for || CurTok == tok_parfor) {
+            bool Parallel = CurTok == tok_parfor;
+            getNextToken(); // eat the for or parfor
+            if (CurTok != tok_identifier)
+                return LogError(Parallel ? "expected identifier after parfor"
+                                         : "expected identifier after for");
+            SymbolID VarName = IdentifierSym;
+            getNextToken(); // eat identifier
+            if (CurTok != '=')
+                return LogError(Parallel ? "expected '=' after parfor"
+                                         : "expected '=' after for");
+            getNextToken(); // eat '='
+            Ops.push_back({Parallel ? PendingOp::ParForStart : PendingOp::ForStart,
+                           0, 0, VarName, (unsigned)Operands.size()});
+            continue;
+        }
+        if (CurTok == tok_var) {
+            getNextToken(); // eat the var
+            Ops.push_back({PendingOp::VarInit, 0, 0, 0, (unsigned)Operands.size()});
+            if (!ParseVarBindings(true))
                 return nullptr;
+            continue;
         }
+        if (CurTok == tok_identifier) {
+            SymbolID IdName = IdentifierSym;
+            getNextToken(); // eat identifier
 
-        // Merge LHS/RHS
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
-    }
-}
+            if (CurTok == '[') {
+                getNextToken(); // eat '['
+                Ops.push_back({PendingOp::Index, 0, 0, IdName, 0});
+                continue;
+            }
+            if (CurTok != '(') {
+                Operands.push_back(AST.getVariable(IdName));
+            } else {
+                // call
+                getNextToken(); // eat '('
+                Ops.push_back({PendingOp::Call, 0, 0, IdName, (unsigned)Operands.size()});
+                if (CurTok != ')')
+                    continue;
+                // no arguments, fall through to the ')' below
+            }
+        } else {
+            ExprAST *Primary = ParsePrimary();
+            if (!Primary)
+                return nullptr;
+            Operands.push_back(Primary);
+        }
 
-// expression 
-//      ::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParsePrimary(); 
-    if (!LHS)
-        return nullptr;
-    return ParseBinOpRHS(0, std::move(LHS)); 
+        // expecting a binary operator, or whatever closes or continues the
+        // innermost '(', call, if, for, parfor or var
+        while (true) {
+            int TokPrec = GetTokPrecedence();
+            if (TokPrec > 0) {
+                // Okay, we know this is a binop. Anything pending that binds
+                // at least as tightly takes the operand to its left first.
+                Reduce(TokPrec);
+                Ops.push_back({PendingOp::Binary, CurTok, TokPrec, 0, 0});
+                getNextToken(); // eat binop
+                break;
+            }
+
+            Reduce(0);
+            if (Ops.empty())
+                return Operands.back();
+
+            PendingOp &Open = Ops.back();
+            if (Open.Kind == PendingOp::Paren) {
+                if (CurTok != ')')
+                    return LogError("expected ')'");
+                getNextToken(); // eat ')'
+                Ops.pop_back();
+                continue;
+            }
+            if (Open.Kind == PendingOp::Index) {
+                if (CurTok != ']')
+                    return LogError("expected ']'");
+                getNextToken(); // eat ']'
+                // what an element holds depends on the stores before it
+                ItemIsPure = false;
+                Operands.back() = AST.getIndex(Open.Name, Operands.back());
+                Ops.pop_back();
+                continue;
+            }
+
+            // on to the next part of an if
+            if (Open.Kind == PendingOp::IfCond) {
+                if (CurTok != tok_then)
+                    return LogError("expected then");
+                getNextToken(); // eat the then
+                Open.Kind = PendingOp::IfThen;
+                break;
+            }
+            if (Open.Kind == PendingOp::IfThen) {
+                if (CurTok != tok_else)
+                    return LogError("expected else");
+                getNextToken(); // eat the else
+                Open.Kind = PendingOp::IfElse;
+                break;
+            }
+
+            // on to the next part of a for
+            if (Open.Kind == PendingOp::ForStart) {
+                if (CurTok != ',')
+                    return LogError("expected ',' after for start value");
+                getNextToken(); // eat ','
+                Open.Kind = PendingOp::ForEnd;
+                break;
+            }
+            if (Open.Kind == PendingOp::ForEnd && CurTok == ',') {
+                getNextToken(); // eat ','
+                Open.Kind = PendingOp::ForStep;
+                break;
+            }
+            if (Open.Kind == PendingOp::ForEnd || Open.Kind == PendingOp::ForStep) {
+                if (CurTok != tok_in)
+                    return LogError("expected 'in' after for");
+                getNextToken(); // eat the in
+                if (Open.Kind == PendingOp::ForEnd)
+                    Operands.push_back(nullptr); // no step
+                Open.Kind = PendingOp::ForBody;
+                break;
+            }
+
+            // on to the next part of a parfor, past its reduce if it has one
+            if (Open.Kind == PendingOp::ParForStart) {
+                if (CurTok != ',')
+                    return LogError("expected ',' after parfor start value");
+                getNextToken(); // eat ','
+                Open.Kind = PendingOp::ParForEnd;
+                break;
+            }
+            if (Open.Kind == PendingOp::ParForEnd) {
+                if (CurTok == tok_reduce) {
+                    getNextToken(); // eat the reduce
+                    if (CurTok != '(')
+                        return LogError("expected '(' after reduce");
+                    getNextToken(); // eat '('
+                    // the values can be combined in any order, so only an
+                    // associative operator will do
+                    if (CurTok != '+' && CurTok != '*')
+                        return LogError("reduce takes '+' or '*'");
+                    Open.Op = CurTok;
+                    getNextToken(); // eat the operator
+                    if (CurTok != ')')
+                        return LogError("expected ')' after reduce operator");
+                    getNextToken(); // eat ')'
+                }
+                if (CurTok != tok_in)
+                    return LogError("expected 'in' after parfor");
+                getNextToken(); // eat the in
+                Open.Kind = PendingOp::ParForBody;
+                break;
+            }
+
+            // on to the next binding of a var, or its body
+            if (Open.Kind == PendingOp::VarInit) {
+                if (!ParseVarBindings(false))
+                    return nullptr;
+                break;
+            }
+            if (Open.Kind == PendingOp::VarBody) {
+                SmallVector<VarBinding, 4> Bindings;
+                for (unsigned I = Open.OperandsBase; I + 1 < Operands.size(); I += 2)
+                    Bindings.push_back({cast<VariableExprAST>(Operands[I])->getName(),
+                                        Operands[I + 1]});
+                ExprAST *E = AST.getVar(Bindings, Operands.back());
+                Operands.truncate(Open.OperandsBase);
+                Operands.push_back(E);
+                Ops.pop_back();
+                continue;
+            }
+
+            // the else branch or loop body ends here, and with it the if or loop
+            if (Open.Kind == PendingOp::IfElse || Open.Kind == PendingOp::ForBody ||
+                Open.Kind == PendingOp::ParForBody) {
+                ExprAST **Parts = Operands.begin() + Open.OperandsBase;
+                ExprAST *E;
+                if (Open.Kind == PendingOp::IfElse)
+                    E = AST.getIf(Parts[0], Parts[1], Parts[2]);
+                else if (Open.Kind == PendingOp::ForBody)
+                    E = AST.getFor(Open.Name, Parts[0], Parts[1], Parts[2], Parts[3]);
+                else
+                    E = AST.getParFor(Open.Name, Open.Op, Parts[0], Parts[1], Parts[2]);
+                Operands.truncate(Open.OperandsBase);
+                Operands.push_back(E);
+                Ops.pop_back();
+                continue;
+            }
+
+            // inside a call's argument list
+            if (CurTok == ',') {
+                getNextToken(); // eat ','
+                break;
+            }
+            if (CurTok != ')')
+                return LogError("Expected ')' or ',' in argument list");
+            getNextToken(); // eat ')'
+
+            ArrayRef<ExprAST *> Args(Operands.begin() + Open.OperandsBase, Operands.end());
+            bool Pure = isBuiltin(Open.Name) || PureFunctions.count(Open.Name);
+            ItemIsPure &= Pure;
+            ExprAST *Call = AST.getCall(Open.Name, Args, Pure);
+            Operands.truncate(Open.OperandsBase);
+            Operands.push_back(Call);
+            Ops.pop_back();
+        }
+    }
 }
 
 // Prototype
-//      ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+//      ::= id '(' (id | id '[' ']')* ')'
+std::unique_ptr<PrototypeAST> CompilerSession::ParsePrototype() {
     if (CurTok != tok_identifier)
         return LogErrorP("Expected function name in prototype");
-    std::string FnName = IdentifierStr; 
+    SymbolID FnName = IdentifierSym;
+    if (isBuiltin(FnName))
+        return LogErrorP("Cannot redefine a builtin");
     getNextToken(); 
 
     if (CurTok != '(')
         return LogErrorP("Expected '(' in prototype"); 
 
-    // Read the list of argument names
-    std::vector<std::string> ArgNames; 
-    while (getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
+    // Read the list of argument names, "a[]" for an array
+    std::vector<SymbolID> ArgNames;
+    std::vector<bool> IsArray;
+    getNextToken(); // eat '('
+    while (CurTok == tok_identifier) {
+        ArgNames.push_back(IdentifierSym);
+        IsArray.push_back(false);
+        if (getNextToken() == '[') {
+            if (getNextToken() != ']')
+                return LogErrorP("Expected ']' after '[' in prototype");
+            getNextToken(); // eat ']'
+            IsArray.back() = true;
+        }
+    }
     if (CurTok != ')')
         return LogErrorP("Expected ')' in prototype"); 
 
     // success 
     getNextToken(); // eat ')'
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames)); 
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), std::move(IsArray)); 
 
 }
 
-// definition ::= 'def' prototype expression 
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-    getNextToken(); // eat def
-    auto Proto = ParsePrototype(); 
-    if (!Proto) 
-        return nullptr; 
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    return nullptr;
+// definition ::= ('precision' '(' mode ')')? 'memo'? 'def' prototype expression
+//   mode ::= 'strict' | 'contract' | 'fast'
+std::unique_ptr<FunctionAST> CompilerSession::ParseDefinition() {
+    FPMode Precision = FP_Session;
+    if (CurTok == tok_precision) {
+        if (getNextToken() != '(') {
+            LogError("Expected '(' after 'precision'");
+            return nullptr;
+        }
+        getNextToken(); // eat '('
+        StringRef Mode = CurTok == tok_identifier ? Symbols.getName(IdentifierSym) : "";
+        if (Mode == "strict")
+            Precision = FP_Strict;
+        else if (Mode == "contract")
+            Precision = FP_Contract;
+        else if (Mode == "fast")
+            Precision = FP_Fast;
+        else {
+            LogError("precision takes strict, contract or fast");
+            return nullptr;
+        }
+        if (getNextToken() != ')') {
+            LogError("Expected ')' after precision mode");
+            return nullptr;
+        }
+        getNextToken(); // eat ')'
+        if (CurTok != tok_memo && CurTok != tok_def) {
+            LogError("Expected 'def' after precision");
+            return nullptr;
+        }
+    }
+    bool Memo = CurTok == tok_memo;
+    if (Memo && getNextToken() != tok_def) {
+        LogError("Expected 'def' after 'memo'");
+        return nullptr;
+    }
+    getNextToken(); // eat def
+    auto Proto = ParsePrototype(); 
+    if (!Proto) 
+        return nullptr; 
+    if (auto E = ParseExpression())
+        return std::make_unique<FunctionAST>(std::move(Proto), E, Memo, Precision);
+    return nullptr;
 }
 
-// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-    getNextToken(); 
+// external ::= 'extern' 'pure'? prototype
+std::unique_ptr<PrototypeAST> CompilerSession::ParseExtern(bool &Pure) {
+    Pure = getNextToken() == tok_pure;
+    if (Pure)
+        getNextToken(); // eat 'pure'
     return ParsePrototype(); 
 }
 
 // toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()) {
-        // Make anon proto
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>()); 
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+std::unique_ptr<FunctionAST> CompilerSession::ParseTopLevelExpr() {
+    if (auto E = ParseExpression())
+        return makeTopLevelFunction(E);
+    return nullptr; 
+}
+
+// makeTopLevelFunction - Wrap the top-level expression E up as an anon
+// function
+std::unique_ptr<FunctionAST> CompilerSession::makeTopLevelFunction(ExprAST *E) {
+    // Make anon proto. A compilation unit keeps all of its top-level
+    // expressions around until it is linked, so each needs its own name.
+    SymbolID Name = sym_anon_expr;
+    if (CompileOnly)
+        Name = Symbols.intern(("__anon_expr." + Twine(UnitID) + "." +
+                               Twine(PendingExprs.size())).str());
+    auto Proto = std::make_unique<PrototypeAST>(Name, std::vector<SymbolID>());
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
+}
+
+// AST simplification
+
+// x*1, x+0, x-0 and x-x are left alone by default: under IEEE arithmetic x+0
+// turns -0 into +0 and x-x is NaN rather than 0 for infinite x
+static cl::opt<bool> SimplifyIdentities(
+    "simplify-identities",
+    cl::desc("Fold x*1, x+0, x-0 and x-x before code generation"),
+    cl::init(false));
+
+// Integer literals stay doubles by default: i64 arithmetic wraps around where
+// double arithmetic would only lose precision
+static cl::opt<bool> IntTypes(
+    "int-types",
+    cl::desc("Give integral literals the type i64, and emit an integer "
+             "specialization of every definition"),
+    cl::init(false));
+
+// isInteger - True if Val is exactly an integer a double can count up to
+static bool isInteger(double Val) {
+    return Val >= -0x1p53 && Val <= 0x1p53 && Val == (double)(int64_t)Val &&
+           !(Val == 0.0 && std::signbit(Val));
+}
+
+// foldBinary - Evaluate Op on two constants into Result, the way the
+// generated code would: with -int-types, integers are i64s, whose arithmetic
+// wraps around. Returns false for an operator it does not know, or for an
+// i64 result that would not be an integer literal again.
+static bool foldBinary(char Op, double L, double R, double &Result) {
+    if (IntTypes && isInteger(L) && isInteger(R)) {
+        // in unsigned arithmetic, for the wrap around to be defined
+        uint64_t A = (int64_t)L, B = (int64_t)R;
+        int64_t V;
+        switch (Op) {
+            case '+':
+                V = (int64_t)(A + B);
+                break;
+            case '-':
+                V = (int64_t)(A - B);
+                break;
+            case '*':
+                V = (int64_t)(A * B);
+                break;
+            case '<':
+                Result = (int64_t)A < (int64_t)B ? 1.0 : 0.0;
+                return true;
+            default:
+                return false;
+        }
+        Result = (double)V;
+        return isInteger(Result);
+    }
+    switch (Op) {
+        case '+':
+            Result = L + R;
+            return true;
+        case '-':
+            Result = L - R;
+            return true;
+        case '*':
+            Result = L * R;
+            return true;
+        case '<': // unordered compares true, like fcmp ult
+            Result = !(L >= R) ? 1.0 : 0.0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isConstant(const ExprAST *E, double Val) {
+    auto *N = dyn_cast<NumberExprAST>(E);
+    return N && N->getVal() == Val;
+}
+
+// simplifyBinary - Simplify Op applied to the already simplified operands L
+// and R, or return null when nothing applies
+static ExprAST *simplifyBinary(ASTContext &AST, char Op, ExprAST *L,
+                               ExprAST *R) {
+    auto *LN = dyn_cast<NumberExprAST>(L);
+    auto *RN = dyn_cast<NumberExprAST>(R);
+    double Folded;
+    if (LN && RN && foldBinary(Op, LN->getVal(), RN->getVal(), Folded))
+        return AST.getNumber(Folded);
+    if (!SimplifyIdentities)
+        return nullptr;
+
+    switch (Op) {
+        case '*':
+            if (isConstant(R, 1.0))
+                return L;
+            if (isConstant(L, 1.0))
+                return R;
+            break;
+        case '+':
+            if (isConstant(R, 0.0))
+                return L;
+            if (isConstant(L, 0.0))
+                return R;
+            break;
+        case '-':
+            if (isConstant(R, 0.0))
+                return L;
+            // Equal operands are one and the same node, and only side effect
+            // free nodes are ever shared
+            if (L == R)
+                return AST.getNumber(0.0);
+            break;
     }
     return nullptr;
 }
+
+// simplify - Return the DAG rooted here with constant subtrees folded into
+// literals, sharing whatever did not change. Walked in post-order with an
+// explicit stack, like codegen, and each node is only simplified once.
+ExprAST *ExprAST::simplify(ASTContext &AST) {
+    struct WorkItem {
+        ExprAST *E;
+        unsigned NextChild;
+    };
+    SmallVector<WorkItem, 32> Work;
+    SmallVector<ExprAST *, 32> Results;
+    DenseMap<ExprAST *, ExprAST *> Simplified;
+    auto Schedule = [&](ExprAST *E) {
+        if (ExprAST *S = Simplified.lookup(E))
+            Results.push_back(S);
+        else
+            Work.push_back({E, 0});
+    };
+    Schedule(this);
+
+    while (!Work.empty()) {
+        WorkItem &W = Work.back();
+        ExprAST *E = W.E;
+        switch (E->getKind()) {
+            case EK_Number:
+            case EK_Variable:
+                break;
+            case EK_Binary: {
+                auto *B = cast<BinaryExprAST>(E);
+                if (W.NextChild < 2) {
+                    Schedule(W.NextChild++ == 0 ? B->getLHS() : B->getRHS());
+                    continue;
+                }
+                ExprAST *R = Results.pop_back_val();
+                ExprAST *L = Results.pop_back_val();
+                if (ExprAST *S = simplifyBinary(AST, B->getOp(), L, R))
+                    E = S;
+                else if (L != B->getLHS() || R != B->getRHS())
+                    E = AST.getBinary(B->getOp(), L, R);
+                break;
+            }
+            case EK_Call: {
+                auto *C = cast<CallExprAST>(E);
+                ArrayRef<ExprAST *> Args = C->getArgs();
+                if (W.NextChild < Args.size()) {
+                    Schedule(Args[W.NextChild++]);
+                    continue;
+                }
+                ArrayRef<ExprAST *> NewArgs = ArrayRef<ExprAST *>(Results).take_back(Args.size());
+                // a call that was not shared before must not become shared now
+                if (NewArgs != Args)
+                    E = AST.getCall(C->getCallee(), NewArgs, C->isShared());
+                Results.truncate(Results.size() - Args.size());
+                break;
+            }
+            case EK_If: {
+                auto *I = cast<IfExprAST>(W.E);
+                ExprAST *Parts[] = {I->getCond(), I->getThen(), I->getElse()};
+                if (W.NextChild < 3) {
+                    Schedule(Parts[W.NextChild++]);
+                    continue;
+                }
+                ExprAST *Else = Results.pop_back_val();
+                ExprAST *Then = Results.pop_back_val();
+                ExprAST *Cond = Results.pop_back_val();
+                // a constant condition picks its branch, tested like the
+                // generated fcmp one: NaN counts as false
+                if (auto *CN = dyn_cast<NumberExprAST>(Cond))
+                    E = CN->getVal() < 0.0 || CN->getVal() > 0.0 ? Then : Else;
+                else if (Cond != Parts[0] || Then != Parts[1] || Else != Parts[2])
+                    E = AST.getIf(Cond, Then, Else);
+                break;
+            }
+            case EK_For: {
+                auto *L = cast<ForExprAST>(W.E);
+                ExprAST *Parts[] = {L->getStart(), L->getEnd(), L->getBody(), L->getStep()};
+                unsigned NumParts = L->getStep() ? 4 : 3;
+                if (W.NextChild < NumParts) {
+                    Schedule(Parts[W.NextChild++]);
+                    continue;
+                }
+                ExprAST *Step = L->getStep() ? Results.pop_back_val() : nullptr;
+                ExprAST *Body = Results.pop_back_val();
+                ExprAST *End = Results.pop_back_val();
+                ExprAST *Start = Results.pop_back_val();
+                if (Start != Parts[0] || End != Parts[1] || Body != Parts[2] ||
+                    Step != Parts[3])
+                    E = AST.getFor(L->getVarName(), Start, End, Step, Body);
+                break;
+            }
+            case EK_Var: {
+                auto *VE = cast<VarExprAST>(W.E);
+                SmallVector<ExprAST *, 8> Parts;
+                VE->forEachOperand([&](ExprAST *Op) { Parts.push_back(Op); });
+                if (W.NextChild < Parts.size()) {
+                    Schedule(Parts[W.NextChild++]);
+                    continue;
+                }
+                ArrayRef<ExprAST *> NewParts = ArrayRef<ExprAST *>(Results).take_back(Parts.size());
+                if (NewParts != ArrayRef<ExprAST *>(Parts)) {
+                    // the initializers come first, in order, then the body
+                    SmallVector<VarBinding, 4> Bindings;
+                    unsigned Next = 0;
+                    for (const VarBinding &B : VE->getBindings())
+                        Bindings.push_back({B.Name, B.Init ? NewParts[Next++] : nullptr});
+                    E = AST.getVar(Bindings, NewParts.back());
+                }
+                Results.truncate(Results.size() - Parts.size());
+                break;
+            }
+            case EK_Index: {
+                auto *I = cast<IndexExprAST>(W.E);
+                if (W.NextChild == 0) {
+                    W.NextChild = 1;
+                    Schedule(I->getIndex());
+                    continue;
+                }
+                ExprAST *Index = Results.pop_back_val();
+                if (Index != I->getIndex())
+                    E = AST.getIndex(I->getArray(), Index);
+                break;
+            }
+            case EK_ParFor: {
+                auto *L = cast<ParForExprAST>(W.E);
+                ExprAST *Parts[] = {L->getStart(), L->getEnd(), L->getBody()};
+                if (W.NextChild < 3) {
+                    Schedule(Parts[W.NextChild++]);
+                    continue;
+                }
+                ExprAST *Body = Results.pop_back_val();
+                ExprAST *End = Results.pop_back_val();
+                ExprAST *Start = Results.pop_back_val();
+                if (Start != Parts[0] || End != Parts[1] || Body != Parts[2])
+                    E = AST.getParFor(L->getVarName(), L->getOp(), Start, End, Body);
+                break;
+            }
+        }
+        Simplified[W.E] = E;
+        Results.push_back(E);
+        Work.pop_back();
+    }
+    return Results.back();
+}
+
+void FunctionAST::simplify(ASTContext &AST) {
+    Body = Body->simplify(AST);
+}
+
 // code generation 
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<Module> TheModule;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::map<std::string, Value *> NamedValues;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::unique_ptr<FunctionPassManager> TheFPM;
-static std::unique_ptr<LoopAnalysisManager> TheLAM;
-static std::unique_ptr<FunctionAnalysisManager> TheFAM;
-static std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
-static std::unique_ptr<ModuleAnalysisManager> TheMAM;
-static std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
-static std::unique_ptr<StandardInstrumentations> TheSI;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
 static ExitOnError ExitOnErr;
-Value *LogErrorV(const char *Str) {
+
+static cl::opt<FPMode> SessionFPMode(
+    "fp-mode",
+    cl::desc("How freely floating point arithmetic may be rearranged, in "
+             "definitions that do not say"),
+    cl::values(clEnumValN(FP_Strict, "strict", "exactly as written"),
+               clEnumValN(FP_Contract, "contract",
+                          "multiplies and adds fused into one rounding"),
+               clEnumValN(FP_Fast, "fast", "any way that is right for real numbers")),
+    cl::init(FP_Strict));
+
+FastMathFlags CompilerSession::getFastMathFlags(FPMode Mode) const {
+    FastMathFlags FMF;
+    switch (Mode == FP_Session ? SessionPrecision : Mode) {
+        case FP_Fast:
+            FMF.setFast();
+            break;
+        case FP_Contract:
+            FMF.setAllowContract();
+            break;
+        default:
+            break;
+    }
+    return FMF;
+}
+
+void CompilerSession::addHostArray(StringRef Name, double *Data, int64_t Len) {
+    HostArrays[Name] = {Data, Len};
+}
+
+void CompilerSession::recordBoundsError(double Index, int64_t Len) {
+    std::lock_guard<std::mutex> Lock(BoundsMutex);
+    if (HasBoundsError)
+        return;
+    HasBoundsError = true;
+    BoundsIndex = Index;
+    BoundsLen = Len;
+}
+
+bool CompilerSession::reportBoundsError() {
+    std::lock_guard<std::mutex> Lock(BoundsMutex);
+    if (!HasBoundsError)
+        return false;
+    HasBoundsError = false;
+    if (!UnitName.empty())
+        fprintf(stderr, "%s: ", UnitName.c_str());
+    fprintf(stderr, "Error: index %g is out of bounds for an array of %lld\n",
+            BoundsIndex, (long long)BoundsLen);
+    return true;
+}
+
+// handleBoundsError - Where generated code goes on an index out of bounds,
+// with the session that generated it. The error is left for the session to
+// report once the code returns; in the meantime the access goes to a slot
+// of the thread's own instead, which reads as NaN.
+static double *handleBoundsError(CompilerSession *S, double Index, int64_t Len) {
+    S->recordBoundsError(Index, Len);
+    static thread_local double Slot;
+    Slot = std::numeric_limits<double>::quiet_NaN();
+    return &Slot;
+}
+static const char BoundsErrorName[] = "__kaleidoscope_bounds_error";
+
+static cl::opt<unsigned> ParForThreads(
+    "parfor-threads",
+    cl::desc("Number of threads to run parfor loops on (default: one per core)"),
+    cl::init(0));
+
+// ParForBody - The body of a parfor loop, outlined into a function of its
+// own: it runs iterations [Lo, Hi), from the variables in Ctx, and gives
+// their values reduced
+using ParForBody = double (*)(void *Ctx, int64_t Lo, int64_t Hi);
+
+static double combine(int Op, double L, double R) {
+    return Op == '*' ? L * R : L + R;
+}
+
+// set on the threads of the pool, and on the thread that started a loop while
+// it works on it
+static thread_local bool InParFor = false;
+
+// ParForPool - The threads parfor loops run on, one per worker but the first,
+// which is the thread that starts the loop.
+//
+// The iterations of a loop are split evenly among the workers up front. Each
+// takes them off the front of its own range a grain at a time, and once that
+// runs dry, steals the back half of the first other range it finds that
+// still holds more than a grain. Work only ever moves by stealing, so once no
+// range is left to steal from, what remains is in the hands of its owner, and
+// the thief is done. Each worker reduces what it runs into a partial value of
+// its own; the partials are combined when the last worker is done.
+class ParForPool {
+    struct Worker {
+        std::mutex M;
+        int64_t Lo = 0, Hi = 0; // the iterations left to this worker
+        double Partial;
+    };
+    unsigned NumWorkers;
+    std::unique_ptr<Worker[]> Workers;
+
+    // held for as long as a loop runs on the pool
+    std::mutex Busy;
+    // the loop being run
+    ParForBody Body;
+    void *Ctx;
+    int Op;
+    uint64_t Grain;
+
+    // guards the fields below, which start the threads on a loop and tell the
+    // starting thread that they are done with it
+    std::mutex M;
+    std::condition_variable Start, Done;
+    uint64_t Generation = 0; // the number of loops started
+    unsigned Running = 0;    // the threads still working on the current loop
+
+    bool steal(Worker &Me, unsigned Self);
+    void work(unsigned Self);
+    void threadMain(unsigned Self);
+
+    public: 
+        explicit ParForPool(unsigned NumWorkers);
+        unsigned getNumWorkers() const { return NumWorkers; }
+        // run - Run iterations [Begin, End) of Body and reduce their values
+        // into Result. Returns false, having run nothing, if the pool is busy
+        // with another loop.
+        bool run(ParForBody Body, void *Ctx, int64_t Begin, int64_t End, int Op,
+                 double &Result);
+};
+
+ParForPool::ParForPool(unsigned NumWorkers)
+    : NumWorkers(NumWorkers), Workers(new Worker[NumWorkers]) {
+    // the threads wait for loops for as long as the process lives
+    for (unsigned I = 1; I != NumWorkers; ++I)
+        std::thread(&ParForPool::threadMain, this, I).detach();
+}
+
+void ParForPool::threadMain(unsigned Self) {
+    InParFor = true;
+    uint64_t Seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> Lock(M);
+            Start.wait(Lock, [&] { return Generation != Seen; });
+            Seen = Generation;
+        }
+        work(Self);
+        std::lock_guard<std::mutex> Lock(M);
+        if (--Running == 0)
+            Done.notify_one();
+    }
+}
+
+// steal - Move the back half of another worker's range to Me, if any has
+// enough left to be worth it
+bool ParForPool::steal(Worker &Me, unsigned Self) {
+    for (unsigned I = 1; I != NumWorkers; ++I) {
+        Worker &Victim = Workers[(Self + I) % NumWorkers];
+        int64_t Lo, Hi;
+        {
+            std::lock_guard<std::mutex> Lock(Victim.M);
+            uint64_t Left = uint64_t(Victim.Hi) - uint64_t(Victim.Lo);
+            if (Victim.Lo >= Victim.Hi || Left <= Grain)
+                continue;
+            Lo = Victim.Lo + int64_t(Left / 2);
+            Hi = Victim.Hi;
+            Victim.Hi = Lo;
+        }
+        std::lock_guard<std::mutex> Lock(Me.M);
+        Me.Lo = Lo;
+        Me.Hi = Hi;
+        return true;
+    }
+    return false;
+}
+
+void ParForPool::work(unsigned Self) {
+    Worker &Me = Workers[Self];
+    double Partial = Op == '*' ? 1.0 : 0.0;
+    while (true) {
+        int64_t Lo, Hi;
+        {
+            std::lock_guard<std::mutex> Lock(Me.M);
+            Lo = Me.Lo;
+            Hi = uint64_t(Me.Hi) - uint64_t(Me.Lo) > Grain ? Lo + int64_t(Grain) : Me.Hi;
+            Me.Lo = Hi;
+        }
+        if (Lo < Hi)
+            Partial = combine(Op, Partial, Body(Ctx, Lo, Hi));
+        else if (!steal(Me, Self))
+            break;
+    }
+    Me.Partial = Partial;
+}
+
+bool ParForPool::run(ParForBody Body, void *Ctx, int64_t Begin, int64_t End,
+                     int Op, double &Result) {
+    std::unique_lock<std::mutex> BusyLock(Busy, std::try_to_lock);
+    if (!BusyLock)
+        return false;
+    this->Body = Body;
+    this->Ctx = Ctx;
+    this->Op = Op;
+    // a few grains per worker, to leave something to steal from one that is
+    // held up, and no more, since each grain is a call
+    uint64_t Count = uint64_t(End) - uint64_t(Begin);
+    Grain = std::max<uint64_t>(Count / (NumWorkers * 8), 1);
+    uint64_t Share = Count / NumWorkers, Extra = Count % NumWorkers;
+    uint64_t Offset = 0;
+    for (unsigned I = 0; I != NumWorkers; ++I) {
+        Worker &W = Workers[I];
+        W.Lo = int64_t(uint64_t(Begin) + Offset);
+        Offset += Share + (I < Extra);
+        W.Hi = int64_t(uint64_t(Begin) + Offset);
+    }
+
+    {
+        std::lock_guard<std::mutex> Lock(M);
+        Running = NumWorkers - 1;
+        ++Generation;
+    }
+    Start.notify_all();
+    InParFor = true;
+    work(0);
+    InParFor = false;
+    {
+        std::unique_lock<std::mutex> Lock(M);
+        Done.wait(Lock, [&] { return Running == 0; });
+    }
+
+    Result = Workers[0].Partial;
+    for (unsigned I = 1; I != NumWorkers; ++I)
+        Result = combine(Op, Result, Workers[I].Partial);
+    return true;
+}
+
+static ParForPool &getParForPool() {
+    // never destroyed: its threads may still be waiting when the process exits
+    static ParForPool *Pool = new ParForPool(
+        ParForThreads ? ParForThreads : std::max(std::thread::hardware_concurrency(), 1u));
+    return *Pool;
+}
+
+// runParFor - Where generated code goes to run a parfor loop. A loop reached
+// from the body of another, or from a second host thread while the pool is
+// busy, runs right where it is, on the thread that reached it.
+static double runParFor(ParForBody Body, void *Ctx, int64_t Begin, int64_t End,
+                        int32_t Op) {
+    if (End <= Begin)
+        return Op == '*' ? 1.0 : 0.0;
+    double Result;
+    if (!InParFor && getParForPool().getNumWorkers() > 1 &&
+        getParForPool().run(Body, Ctx, Begin, End, Op, Result))
+        return Result;
+    return Body(Ctx, Begin, End);
+}
+static const char ParForName[] = "__kaleidoscope_parfor";
+
+Value *CompilerSession::LogErrorV(const char *Str) {
     LogError(Str); 
     return nullptr;
 }
 
-Value *NumberExprAST::codegen() {
-    return ConstantFP::get(*TheContext, APFloat(Val));
+void CompilerSession::bindInScope(SymbolID Var, AllocaInst *A) {
+    ValueScope &Scope = ValueScopes.back();
+    auto [It, Inserted] = NamedValues.try_emplace(Var, A);
+    if (!Inserted) {
+        // what the scope has so far may have been read from the old binding
+        Scope.Values.clear();
+        Scope.Barrier = true;
+        Scope.Shadowed.push_back({Var, It->second});
+        It->second = A;
+    } else {
+        Scope.Shadowed.push_back({Var, nullptr});
+    }
+}
+
+void CompilerSession::popValueScope() {
+    for (auto [Var, Old] : reverse(ValueScopes.back().Shadowed)) {
+        if (Old)
+            NamedValues[Var] = Old;
+        else
+            NamedValues.erase(Var);
+    }
+    ValueScopes.pop_back();
+}
+
+// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
+// the function. This is used for mutable variables etc. 
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName,
+                                          Type *Ty) {
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Ty, nullptr, VarName);
+}
+
+Value *CompilerSession::getConstant(double Val) {
+    if (IntTypes && isInteger(Val))
+        return Builder->getInt64((int64_t)Val);
+    return ConstantFP::get(*TheContext, APFloat(Val));
+}
+
+Type *CompilerSession::joinTypes(Type *A, Type *B) {
+    if (A == B)
+        return A;
+    // an array only goes with itself
+    if (A->isStructTy() || B->isStructTy())
+        return nullptr;
+    if (A->isVectorTy() || B->isVectorTy()) {
+        if (A->isVectorTy() && B->isVectorTy())
+            return nullptr;
+        return A->isVectorTy() ? A : B;
+    }
+    if (A->isDoubleTy() || B->isDoubleTy())
+        return Builder->getDoubleTy();
+    return Builder->getInt64Ty();
+}
+
+Value *CompilerSession::convertTo(Value *V, Type *Ty) {
+    Type *From = V->getType();
+    if (From == Ty)
+        return V;
+    if (From->isStructTy())
+        return LogErrorV("array used where a value is expected");
+    if (Ty && Ty->isStructTy())
+        return LogErrorV("expected an array");
+    // no type, for a value joined with an array or with a vector of
+    // another width
+    if (!Ty && !From->isVectorTy())
+        return LogErrorV("array used where a value is expected");
+    if (!Ty || From->isVectorTy()) {
+        if (!Ty || Ty->isVectorTy())
+            return LogErrorV("vectors of different widths");
+        if (Ty->isIntegerTy(1))
+            return LogErrorV("vector used as a condition");
+        return LogErrorV("vector used where a number is expected");
+    }
+    if (auto *VecTy = dyn_cast<FixedVectorType>(Ty)) {
+        Value *Elt = convertTo(V, VecTy->getElementType());
+        return Builder->CreateVectorSplat(VecTy->getNumElements(), Elt, "splat");
+    }
+    // to a truth value, the way a condition is tested: nonzero and not NaN
+    if (Ty->isIntegerTy(1)) {
+        if (From->isDoubleTy())
+            return Builder->CreateFCmpONE(V, ConstantFP::get(From, 0.0), "tobool");
+        return Builder->CreateICmpNE(V, ConstantInt::get(From, 0), "tobool");
+    }
+    if (Ty->isDoubleTy()) {
+        // convert bool 0/1 to double 0.0 or 1.0
+        if (From->isIntegerTy(1))
+            return Builder->CreateUIToFP(V, Ty, "booltmp");
+        return Builder->CreateSIToFP(V, Ty, "inttmp");
+    }
+    // bool to i64; nothing ever narrows a double
+    return Builder->CreateZExt(V, Ty, "booltmp");
+}
+
+AllocaInst *CompilerSession::createSlot(const ExprAST *Owner, unsigned Index,
+                                        StringRef Name, Type *Ty) {
+    SlotKey Key(Owner, Index);
+    if (Type *Known = SlotTypes.lookup(Key))
+        if (Type *Joined = joinTypes(Known, Ty))
+            Ty = Joined;
+    AllocaInst *Alloca = CreateEntryBlockAlloca(Builder->GetInsertBlock()->getParent(),
+                                                Name, Ty);
+    SlotOf[Alloca] = Key;
+    return Alloca;
+}
+
+// storeToSlot - Store V to Slot, noting if the slot's type is too narrow.
+// Returns false if no slot could hold both.
+bool CompilerSession::storeToSlot(Value *V, AllocaInst *Slot) {
+    Type *SlotTy = Slot->getAllocatedType();
+    Type *Ty = joinTypes(SlotTy, V->getType());
+    if (!Ty) {
+        if (SlotTy->isStructTy() || V->getType()->isStructTy())
+            LogError("an array and a value cannot share a variable");
+        else
+            LogError("vectors of different widths");
+        return false;
+    }
+    if (Ty != SlotTy) {
+        // the store is moot, the body is generated again with the slot widened
+        SlotTypes[SlotOf.lookup(Slot)] = Ty;
+        NeedsRetry = true;
+        return true;
+    }
+    if (!(V = convertTo(V, SlotTy)))
+        return false;
+    Builder->CreateStore(V, Slot);
+    return true;
+}
+
+// emitFunctionBody - Generate Body into the empty function F, with the
+// arguments of P, up to but not including the return. Returns the body's
+// value, or null on error.
+Value *CompilerSession::emitFunctionBody(Function *F, const PrototypeAST &P,
+                                         ExprAST *Body) {
+    SlotTypes.clear();
+    findTailCalls(Body);
+    while (true) {
+        Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", F));
+        // Record the function arguments in the NamedValues map, each in a
+        // stack slot of its own so the body can assign to it
+        NamedValues.clear();
+        SlotOf.clear();
+        resetValueScopes();
+        NeedsRetry = false;
+        auto ArgIt = F->arg_begin();
+        for (unsigned I = 0, E = P.getArgs().size(); I != E; ++I) {
+            Value *V = &*ArgIt++;
+            if (P.isArrayArg(I)) {
+                V = Builder->CreateInsertValue(UndefValue::get(getArrayType()), V, 0);
+                V = Builder->CreateInsertValue(V, &*ArgIt++, 1);
+            }
+            StringRef Name = Symbols.getName(P.getArgs()[I]);
+            AllocaInst *Alloca = createSlot(nullptr, I, Name, V->getType());
+            storeToSlot(V, Alloca);
+            NamedValues[P.getArgs()[I]] = Alloca;
+        }
+
+        Value *V = Body->codegen(*this);
+        if (!NeedsRetry)
+            return V;
+        // some slot was too narrow, start over with it widened; the slots
+        // only ever widen, so this ends
+        deleteFunctionBody(F);
+    }
+}
+
+// findTailCalls - Find the calls whose value is the value of Body: Body
+// itself, or a call in tail position in the branches of an if or the body of
+// a var that is. The backend turns a call marked tail there into a jump, so
+// recursion through them, in any number of functions, runs in constant stack
+// space, and TailCallElim turns the ones back to the function itself into a
+// loop.
+void CompilerSession::findTailCalls(ExprAST *Body) {
+    TailCalls.clear();
+    SmallPtrSet<ExprAST *, 8> Visited;
+    SmallVector<ExprAST *, 8> Work{Body};
+    while (!Work.empty()) {
+        ExprAST *E = Work.pop_back_val();
+        if (!Visited.insert(E).second)
+            continue;
+        if (auto *I = dyn_cast<IfExprAST>(E)) {
+            Work.push_back(I->getThen());
+            Work.push_back(I->getElse());
+        } else if (auto *V = dyn_cast<VarExprAST>(E)) {
+            Work.push_back(V->getBody());
+        } else if (isa<CallExprAST>(E)) {
+            TailCalls.insert(E);
+        }
+    }
+}
+
+void CompilerSession::deleteFunctionBody(Function *F) {
+    SmallSetVector<Function *, 4> Outlined;
+    for (BasicBlock &BB : *F)
+        for (Instruction &I : BB)
+            for (Value *Op : I.operands())
+                if (auto *G = dyn_cast<Function>(Op))
+                    if (G->hasInternalLinkage())
+                        Outlined.insert(G);
+    F->deleteBody();
+    for (Function *G : Outlined) {
+        if (!G->use_empty())
+            continue;
+        deleteFunctionBody(G);
+        // it has been optimized already
+        TheFAM->clear(*G, G->getName());
+        G->eraseFromParent();
+    }
+}
+
+// getSpecialization - The integer specialization of the function Name, or
+// a declaration of it. Only generated code calls it, so it uses tailcc, where
+// a tail call from one specialization to another is always a jump, whatever
+// arguments it passes.
+Function *CompilerSession::getSpecialization(SymbolID Name) {
+    std::string SpecName = (Symbols.getName(Name) + ".i").str();
+    if (Function *F = TheModule->getFunction(SpecName))
+        return F;
+    auto &P = *FunctionProtos.find(Name)->second;
+    unsigned RetBits = IntSpecializations.lookup(Name);
+    Type *RetTy = RetBits ? (Type *)Builder->getIntNTy(RetBits) : Builder->getDoubleTy();
+    FunctionType *FT = getFunctionType(P, Builder->getInt64Ty(), RetTy);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, SpecName, TheModule.get());
+    F->setCallingConv(CallingConv::Tail);
+    nameArgs(F, P);
+    addFunctionAttrs(F, FunctionInfos.lookup(Name));
+    return F;
+}
+
+// emitSpecialization - Emit the definition P, Body again, as NAME.i taking i64
+// arguments, for the calls whose arguments are all integers (or arrays). Its return type
+// is whatever the body turns out to give. A recursive call has to assume one
+// before that is known, so the body is generated with the narrowest guess
+// first and again with a wider one for as long as the guess falls short.
+Function *CompilerSession::emitSpecialization(const PrototypeAST &P, ExprAST *Body) {
+    SymbolID Name = P.getName();
+    Type *RetTy = Builder->getInt1Ty();
+    while (true) {
+        IntSpecializations[Name] = RetTy->isDoubleTy() ? 0 : RetTy->getIntegerBitWidth();
+        Function *F = getSpecialization(Name);
+        Value *V = emitFunctionBody(F, P, Body);
+        Type *Ty = V ? joinTypes(RetTy, V->getType()) : nullptr;
+        if (Ty == RetTy) {
+            Builder->CreateRet(convertTo(V, RetTy));
+            verifyFunction(*F);
+            TheFPM->run(*F, *TheFAM);
+            return F;
+        }
+        deleteFunctionBody(F);
+        F->eraseFromParent();
+        if (!V) {
+            IntSpecializations.erase(Name);
+            return nullptr;
+        }
+        RetTy = Ty;
+    }
+}
+
+static cl::opt<unsigned> MemoEntries(
+    "memo-entries",
+    cl::desc("Number of results the cache of each memoized function holds"),
+    cl::init(4096));
+
+// the entries of a memoized function's cache that an argument list may be in
+static const unsigned MemoProbes = 4;
+
+// emitMemoCache - Generate F as a cache of the results of BodyF, which has
+// the same arguments, all doubles. The cache is a table of MemoEntries
+// entries, each the hash of an argument list (0 if the entry is empty), the
+// bits of the arguments, and the result. A list may go in any of MemoProbes
+// entries from where its hash points; once all of them are full, a new
+// result replaces the first.
+//
+// The cache is guarded by a lock that is only ever tried: a call that finds
+// it taken, by a call to the same function on another thread of a parfor,
+// goes straight to BodyF. The lock is not held while BodyF runs, so the
+// recursive calls of a body get at the cache as well.
+void CompilerSession::emitMemoCache(Function *F, Function *BodyF) {
+    Type *I64Ty = Builder->getInt64Ty(), *DoubleTy = Builder->getDoubleTy();
+    unsigned NumArgs = F->arg_size();
+    SmallVector<Type *, 8> Fields(NumArgs + 1, I64Ty);
+    Fields.push_back(DoubleTy);
+    StructType *EntryTy = StructType::get(*TheContext, Fields);
+    uint64_t NumEntries = PowerOf2Ceil(std::max<uint64_t>(MemoEntries, MemoProbes));
+    ArrayType *TableTy = ArrayType::get(EntryTy, NumEntries);
+    auto *Table = new GlobalVariable(*TheModule, TableTy, false,
+                                     GlobalValue::InternalLinkage,
+                                     ConstantAggregateZero::get(TableTy),
+                                     F->getName() + ".cache");
+    auto *Lock = new GlobalVariable(*TheModule, Builder->getInt8Ty(), false,
+                                    GlobalValue::InternalLinkage,
+                                    Builder->getInt8(0), F->getName() + ".lock");
+    auto TryLock = [&] {
+        Value *Old = Builder->CreateAtomicRMW(AtomicRMWInst::Xchg, Lock, Builder->getInt8(1),
+                                              MaybeAlign(1), AtomicOrdering::Acquire);
+        return Builder->CreateICmpEQ(Old, Builder->getInt8(0), "locked");
+    };
+    auto Unlock = [&] {
+        Builder->CreateAlignedStore(Builder->getInt8(0), Lock, MaybeAlign(1))
+            ->setAtomic(AtomicOrdering::Release);
+    };
+
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", F));
+    SmallVector<Value *, 8> Args, Keys;
+    Value *Hash = Builder->getInt64(0);
+    for (Argument &A : F->args()) {
+        Args.push_back(&A);
+        Keys.push_back(Builder->CreateBitCast(&A, I64Ty, A.getName() + ".bits"));
+        Hash = Builder->CreateMul(Builder->CreateXor(Hash, Keys.back()),
+                                  Builder->getInt64(0x9E3779B97F4A7C15));
+    }
+    // numbers like 1.0 have no bits set at the bottom, so the high bits are
+    // mixed down into the low ones the table index is taken from
+    Hash = Builder->CreateXor(Hash, Builder->CreateLShr(Hash, 32));
+    Hash = Builder->CreateMul(Hash, Builder->getInt64(0xD6E8FEB86659FD93));
+    Hash = Builder->CreateXor(Hash, Builder->CreateLShr(Hash, 32), "hash");
+    Value *Tag = Builder->CreateOr(Hash, 1, "tag"); // an empty entry's is 0
+    Value *Home = Builder->CreateAnd(Hash, NumEntries - 1, "home");
+    // the entries the argument list may be in
+    SmallVector<Value *, MemoProbes> Entries;
+    for (unsigned P = 0; P != MemoProbes; ++P) {
+        Value *Idx = Builder->CreateAnd(Builder->CreateAdd(Home, Builder->getInt64(P)),
+                                        NumEntries - 1);
+        Entries.push_back(Builder->CreateInBoundsGEP(TableTy, Table,
+                                                     {Builder->getInt64(0), Idx}, "entry"));
+    }
+
+    BasicBlock *LookupBB = BasicBlock::Create(*TheContext, "lookup", F);
+    BasicBlock *HitBB = BasicBlock::Create(*TheContext, "hit", F);
+    BasicBlock *MissBB = BasicBlock::Create(*TheContext, "miss", F);
+    BasicBlock *ComputeBB = BasicBlock::Create(*TheContext, "compute", F);
+    Builder->CreateCondBr(TryLock(), LookupBB, ComputeBB);
+
+    // look in each entry in turn, stopping at the first that holds the list
+    Builder->SetInsertPoint(LookupBB);
+    PHINode *HitEntry = PHINode::Create(Entries[0]->getType(), MemoProbes, "hitentry", HitBB);
+    for (unsigned P = 0; P != MemoProbes; ++P) {
+        Value *EntryTag = Builder->CreateLoad(
+            I64Ty, Builder->CreateStructGEP(EntryTy, Entries[P], 0), "entrytag");
+        Value *Match = Builder->CreateICmpEQ(EntryTag, Tag, "match");
+        for (unsigned I = 0; I != NumArgs; ++I) {
+            Value *Key = Builder->CreateLoad(
+                I64Ty, Builder->CreateStructGEP(EntryTy, Entries[P], I + 1), "entrykey");
+            Match = Builder->CreateAnd(Match, Builder->CreateICmpEQ(Key, Keys[I]), "match");
+        }
+        BasicBlock *NextBB = P + 1 == MemoProbes
+            ? MissBB : BasicBlock::Create(*TheContext, "probe", F, HitBB);
+        HitEntry->addIncoming(Entries[P], Builder->GetInsertBlock());
+        Builder->CreateCondBr(Match, HitBB, NextBB);
+        Builder->SetInsertPoint(NextBB);
+    }
+
+    Builder->SetInsertPoint(HitBB);
+    Value *Cached = Builder->CreateLoad(
+        DoubleTy, Builder->CreateStructGEP(EntryTy, HitEntry, NumArgs + 1), "cached");
+    Unlock();
+    Builder->CreateRet(Cached);
+
+    // the result goes in the first of the entries that is empty, or over the
+    // first if none is. The lock has been let go of since the lookup, so the
+    // tags are read again.
+    Builder->SetInsertPoint(MissBB);
+    Unlock();
+    Builder->CreateBr(ComputeBB);
+    Builder->SetInsertPoint(ComputeBB);
+    CallInst *Result = Builder->CreateCall(BodyF, Args, "result");
+    Result->setCallingConv(BodyF->getCallingConv());
+    BasicBlock *InsertBB = BasicBlock::Create(*TheContext, "insert", F);
+    BasicBlock *RetBB = BasicBlock::Create(*TheContext, "ret", F);
+    Builder->CreateCondBr(TryLock(), InsertBB, RetBB);
+
+    Builder->SetInsertPoint(InsertBB);
+    Value *Entry = Entries[0];
+    for (unsigned P = MemoProbes; P-- != 0;) {
+        Value *EntryTag = Builder->CreateLoad(
+            I64Ty, Builder->CreateStructGEP(EntryTy, Entries[P], 0), "entrytag");
+        Value *Empty = Builder->CreateICmpEQ(EntryTag, Builder->getInt64(0), "empty");
+        Entry = Builder->CreateSelect(Empty, Entries[P], Entry, "slot");
+    }
+    Builder->CreateStore(Tag, Builder->CreateStructGEP(EntryTy, Entry, 0));
+    for (unsigned I = 0; I != NumArgs; ++I)
+        Builder->CreateStore(Keys[I], Builder->CreateStructGEP(EntryTy, Entry, I + 1));
+    Builder->CreateStore(Result, Builder->CreateStructGEP(EntryTy, Entry, NumArgs + 1));
+    Unlock();
+    Builder->CreateBr(RetBB);
+
+    Builder->SetInsertPoint(RetBB);
+    Builder->CreateRet(Result);
+}
+
+// codegen - Generate code for the whole DAG rooted here. It is walked in
+// post-order with an explicit work stack, so however deeply an expression
+// nests, codegen uses a constant amount of native stack. Interior nodes get
+// the values of their operands handed to their own codegen(). A node
+// already emitted in a scope that is still open is not generated again, its
+// value is simply reused.
+//
+// An if and a for are generated in stages, one per operand, with the blocks
+// and values that later stages need kept in their work item. The body of a
+// parfor goes into a function of its own, generated by a walk of its own, so
+// only nested parfor loops take any more native stack.
+Value *ExprAST::codegen(CompilerSession &S) {
+    struct WorkItem {
+        ExprAST *E;
+        unsigned NextChild;   // operands already scheduled
+        Function *CalleeF;    // EK_Call: resolved before its arguments
+        BasicBlock *BB1, *BB2; // EK_If: else or then end block, merge block; EK_For: loop block
+        Value *V1, *V2;       // EK_If: then value; EK_For: the variable's slot, the step
+    };
+    SmallVector<WorkItem, 32> Work;
+    SmallVector<Value *, 32> Values;
+    auto Schedule = [&](ExprAST *E) {
+        if (Value *V = S.lookupEmitted(E))
+            Values.push_back(V);
+        else
+            Work.push_back({E, 0, nullptr, nullptr, nullptr, nullptr, nullptr});
+    };
+    Schedule(this);
+
+    while (!Work.empty()) {
+        WorkItem &W = Work.back();
+        Value *V = nullptr;
+        switch (W.E->getKind()) {
+            case EK_Number:
+                V = cast<NumberExprAST>(W.E)->codegen(S);
+                break;
+            case EK_Variable:
+                V = cast<VariableExprAST>(W.E)->codegen(S);
+                break;
+            case EK_Binary: {
+                auto *B = cast<BinaryExprAST>(W.E);
+                if (B->getOp() == '=') {
+                    // the LHS names the variable or element stored to, so
+                    // only an element's index is evaluated, then the RHS
+                    auto *Elt = dyn_cast<IndexExprAST>(B->getLHS());
+                    if (W.NextChild == 0) {
+                        W.NextChild = 1;
+                        if (Elt) {
+                            Schedule(Elt->getIndex());
+                            continue;
+                        }
+                    }
+                    if (W.NextChild == 1) {
+                        W.NextChild = 2;
+                        Schedule(B->getRHS());
+                        continue;
+                    }
+                    Value *Val = Values.pop_back_val();
+                    V = B->codegenAssign(S, Val, Elt ? Values.pop_back_val() : nullptr);
+                    break;
+                }
+                if (W.NextChild < 2) {
+                    Schedule(W.NextChild++ == 0 ? B->getLHS() : B->getRHS());
+                    continue;
+                }
+                Value *R = Values.pop_back_val();
+                Value *L = Values.pop_back_val();
+                V = B->codegen(S, L, R);
+                break;
+            }
+            case EK_Call: {
+                auto *C = cast<CallExprAST>(W.E);
+                ArrayRef<ExprAST *> Args = C->getArgs();
+                if (W.NextChild == 0 && !W.CalleeF && !isBuiltin(C->getCallee())) {
+                    W.CalleeF = C->resolveCallee(S);
+                    if (!W.CalleeF)
+                        return nullptr;
+                }
+                if (W.NextChild < Args.size()) {
+                    Schedule(Args[W.NextChild++]);
+                    continue;
+                }
+                ArrayRef<Value *> ArgsV = ArrayRef<Value *>(Values).take_back(Args.size());
+                V = W.CalleeF ? C->codegen(S, W.CalleeF, ArgsV) : C->codegenBuiltin(S, ArgsV);
+                Values.truncate(Values.size() - Args.size());
+                break;
+            }
+            case EK_If: {
+                auto *I = cast<IfExprAST>(W.E);
+                Function *TheFunction = S.Builder->GetInsertBlock()->getParent();
+                if (W.NextChild == 0) {
+                    W.NextChild = 1;
+                    Schedule(I->getCond());
+                    continue;
+                }
+                if (W.NextChild == 1) {
+                    Value *CondV = S.convertTo(Values.pop_back_val(), S.Builder->getInt1Ty());
+                    if (!CondV)
+                        return nullptr;
+                    // the else and merge blocks are only put into the function
+                    // once the code before them is there
+                    BasicBlock *ThenBB = BasicBlock::Create(*S.TheContext, "then", TheFunction);
+                    W.BB1 = BasicBlock::Create(*S.TheContext, "else");
+                    W.BB2 = BasicBlock::Create(*S.TheContext, "ifcont");
+                    S.Builder->CreateCondBr(CondV, ThenBB, W.BB1);
+                    S.Builder->SetInsertPoint(ThenBB);
+                    S.pushValueScope();
+                    W.NextChild = 2;
+                    Schedule(I->getThen());
+                    continue;
+                }
+                if (W.NextChild == 2) {
+                    W.V1 = Values.pop_back_val();
+                    S.popValueScope();
+                    S.Builder->CreateBr(W.BB2);
+                    // the then branch may have ended up in a block of its own
+                    BasicBlock *ElseBB = W.BB1;
+                    W.BB1 = S.Builder->GetInsertBlock();
+                    ElseBB->insertInto(TheFunction);
+                    S.Builder->SetInsertPoint(ElseBB);
+                    S.pushValueScope();
+                    W.NextChild = 3;
+                    Schedule(I->getElse());
+                    continue;
+                }
+                // both branches give a value of the type that holds either
+                Value *ElseV = Values.pop_back_val();
+                Type *Ty = S.joinTypes(W.V1->getType(), ElseV->getType());
+                S.popValueScope();
+                ElseV = S.convertTo(ElseV, Ty);
+                if (!ElseV)
+                    return nullptr;
+                S.Builder->CreateBr(W.BB2);
+                BasicBlock *ElseEndBB = S.Builder->GetInsertBlock();
+                S.Builder->SetInsertPoint(W.BB1->getTerminator());
+                W.V1 = S.convertTo(W.V1, Ty);
+                if (!W.V1)
+                    return nullptr;
+                W.BB2->insertInto(TheFunction);
+                S.Builder->SetInsertPoint(W.BB2);
+                PHINode *PN = S.Builder->CreatePHI(Ty, 2, "iftmp");
+                PN->addIncoming(W.V1, W.BB1);
+                PN->addIncoming(ElseV, ElseEndBB);
+                V = PN;
+                break;
+            }
+            case EK_Index: {
+                auto *I = cast<IndexExprAST>(W.E);
+                if (W.NextChild == 0) {
+                    W.NextChild = 1;
+                    Schedule(I->getIndex());
+                    continue;
+                }
+                V = I->codegen(S, Values.pop_back_val());
+                break;
+            }
+            case EK_ParFor: {
+                auto *L = cast<ParForExprAST>(W.E);
+                if (W.NextChild < 2) {
+                    Schedule(W.NextChild++ == 0 ? L->getStart() : L->getEnd());
+                    continue;
+                }
+                Value *EndV = Values.pop_back_val();
+                Value *StartV = Values.pop_back_val();
+                V = L->codegen(S, StartV, EndV);
+                break;
+            }
+            case EK_For: {
+                // the loop runs the body, then tests the end condition and
+                // steps the variable, so it always runs at least once
+                auto *L = cast<ForExprAST>(W.E);
+                if (W.NextChild == 0) {
+                    W.NextChild = 1;
+                    Schedule(L->getStart());
+                    continue;
+                }
+                if (W.NextChild == 1) {
+                    // the variable lives in a stack slot of its own, so the
+                    // body can assign to it
+                    BasicBlock *PreheaderBB = S.Builder->GetInsertBlock();
+                    Value *StartV = Values.pop_back_val();
+                    AllocaInst *Alloca = S.createSlot(W.E, 0, S.Symbols.getName(L->getVarName()),
+                                                      StartV->getType());
+                    if (!S.storeToSlot(StartV, Alloca))
+                        return nullptr;
+                    BasicBlock *LoopBB = BasicBlock::Create(
+                        *S.TheContext, "loop", PreheaderBB->getParent());
+                    S.Builder->CreateBr(LoopBB);
+                    S.Builder->SetInsertPoint(LoopBB);
+                    // within the loop the variable shadows any existing
+                    // variable of the same name
+                    S.pushValueScope(/*Barrier=*/true);
+                    S.bindInScope(L->getVarName(), Alloca);
+                    W.V1 = Alloca;
+                    W.BB1 = LoopBB;
+                    W.NextChild = 2;
+                    Schedule(L->getBody());
+                    continue;
+                }
+                if (W.NextChild == 2) {
+                    Values.pop_back(); // the body's value is ignored
+                    W.NextChild = 3;
+                    if (L->getStep())
+                        Schedule(L->getStep());
+                    else
+                        Values.push_back(S.getConstant(1.0));
+                    continue;
+                }
+                if (W.NextChild == 3) {
+                    W.V2 = Values.pop_back_val(); // the step
+                    W.NextChild = 4;
+                    Schedule(L->getEnd());
+                    continue;
+                }
+                Value *EndCond = S.convertTo(Values.pop_back_val(), S.Builder->getInt1Ty());
+                if (!EndCond)
+                    return nullptr;
+                // reload the variable, which the body may have changed,
+                // and step it
+                auto *Alloca = cast<AllocaInst>(W.V1);
+                Value *CurVar = S.Builder->CreateLoad(Alloca->getAllocatedType(), Alloca,
+                                                      S.Symbols.getName(L->getVarName()));
+                Value *NextVar = S.emitArith('+', CurVar, W.V2, "nextvar");
+                if (!NextVar || !S.storeToSlot(NextVar, Alloca))
+                    return nullptr;
+                BasicBlock *AfterBB = BasicBlock::Create(
+                    *S.TheContext, "afterloop", W.BB1->getParent());
+                S.Builder->CreateCondBr(EndCond, W.BB1, AfterBB);
+                S.Builder->SetInsertPoint(AfterBB);
+                S.popValueScope();
+                // for expr always returns 0.0
+                V = S.getConstant(0.0);
+                break;
+            }
+            case EK_Var: {
+                // NextChild counts the steps taken: evaluating and then
+                // binding each variable in turn, so an initializer sees the
+                // variables before it, and then the body
+                auto *VE = cast<VarExprAST>(W.E);
+                ArrayRef<VarBinding> Bindings = VE->getBindings();
+                if (W.NextChild == 0)
+                    S.pushValueScope();
+                if (W.NextChild < 2 * Bindings.size()) {
+                    const VarBinding &B = Bindings[W.NextChild / 2];
+                    if (W.NextChild++ % 2 == 0) {
+                        if (B.Init)
+                            Schedule(B.Init);
+                        else
+                            Values.push_back(S.getConstant(0.0));
+                        continue;
+                    }
+                    Value *InitV = Values.pop_back_val();
+                    AllocaInst *Alloca = S.createSlot(W.E, W.NextChild / 2 - 1,
+                                                      S.Symbols.getName(B.Name),
+                                                      InitV->getType());
+                    if (!S.storeToSlot(InitV, Alloca))
+                        return nullptr;
+                    S.bindInScope(B.Name, Alloca);
+                    continue;
+                }
+                if (W.NextChild == 2 * Bindings.size()) {
+                    W.NextChild++;
+                    Schedule(VE->getBody());
+                    continue;
+                }
+                V = Values.pop_back_val();
+                S.popValueScope();
+                break;
+            }
+        }
+        if (!V)
+            return nullptr;
+        S.setEmitted(W.E, V);
+        Values.push_back(V);
+        Work.pop_back();
+    }
+    return Values.back();
+}
+
+Value *NumberExprAST::codegen(CompilerSession &S) {
+    return S.getConstant(Val);
+}
+
+Value *CompilerSession::loadVariable(SymbolID Name) {
+    // look this variable up in the function 
+    if (AllocaInst *A = NamedValues.lookup(Name))
+        return Builder->CreateLoad(A->getAllocatedType(), A, Symbols.getName(Name));
+    // or else among the host's arrays, which the address and length of are
+    // known now
+    auto It = HostArrays.find(Symbols.getName(Name));
+    if (It == HostArrays.end())
+        return LogErrorV("Unknown variable name");
+    Constant *Ptr = ConstantExpr::getIntToPtr(
+        Builder->getInt64(reinterpret_cast<uintptr_t>(It->second.Data)),
+        PointerType::getUnqual(*TheContext));
+    return ConstantStruct::get(getArrayType(), {Ptr, Builder->getInt64(It->second.Len)});
+}
+
+Value *VariableExprAST::codegen(CompilerSession &S) {
+    return S.loadVariable(Name);
+}
+
+StructType *CompilerSession::getArrayType() {
+    return StructType::get(PointerType::getUnqual(*TheContext), Builder->getInt64Ty());
+}
+
+Value *CompilerSession::emitElementAddress(Value *Array, Value *Index) {
+    if (!Array->getType()->isStructTy())
+        return LogErrorV("subscripted value is not an array");
+    Type *IndexTy = Index->getType();
+    if (IndexTy->isStructTy() || IndexTy->isVectorTy())
+        return LogErrorV("array index must be a number");
+
+    // a double index is truncated toward zero. The unsigned compare takes a
+    // negative index for a huge one, so one check covers both bounds; in the
+    // form IRCE looks for, it can take the check out of a counted loop.
+    Value *Len = Builder->CreateExtractValue(Array, 1, "len");
+    Value *Idx, *InBounds;
+    if (IndexTy->isDoubleTy()) {
+        // saturated, and NaN checked for apart, since fptosi gives poison
+        // for either
+        Idx = Builder->CreateIntrinsic(Intrinsic::fptosi_sat,
+                                       {Builder->getInt64Ty(), IndexTy}, {Index},
+                                       nullptr, "idx");
+        InBounds = Builder->CreateAnd(
+            Builder->CreateICmpULT(Idx, Len),
+            Builder->CreateFCmpORD(Index, ConstantFP::get(IndexTy, 0.0)), "inbounds");
+    } else {
+        Idx = convertTo(Index, Builder->getInt64Ty());
+        InBounds = Builder->CreateICmpULT(Idx, Len, "inbounds");
+    }
+
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock *InBoundsBB = BasicBlock::Create(*TheContext, "inbounds", TheFunction);
+    BasicBlock *FailBB = BasicBlock::Create(*TheContext, "outofbounds", TheFunction);
+    Builder->CreateCondBr(InBounds, InBoundsBB, FailBB,
+                          MDBuilder(*TheContext).createBranchWeights(2000, 1));
+
+    // the handler is told which session this is, to keep the error for, and
+    // gives back the address for the access to go to instead
+    Builder->SetInsertPoint(FailBB);
+    PointerType *PtrTy = PointerType::getUnqual(*TheContext);
+    FunctionCallee ReportFn = TheModule->getOrInsertFunction(
+        BoundsErrorName, PtrTy, PtrTy, Builder->getDoubleTy(), Builder->getInt64Ty());
+    cast<Function>(ReportFn.getCallee())->addFnAttr(Attribute::Cold);
+    Constant *Self = ConstantExpr::getIntToPtr(
+        Builder->getInt64(reinterpret_cast<uintptr_t>(this)), PtrTy);
+    Value *Slot = Builder->CreateCall(
+        ReportFn, {Self, convertTo(Index, Builder->getDoubleTy()), Len}, "slot");
+    BasicBlock *ContBB = BasicBlock::Create(*TheContext, "eltcont", TheFunction);
+    Builder->CreateBr(ContBB);
+
+    Builder->SetInsertPoint(InBoundsBB);
+    Value *Ptr = Builder->CreateExtractValue(Array, 0, "elts");
+    Value *EltPtr =
+        Builder->CreateInBoundsGEP(Builder->getDoubleTy(), Ptr, Idx, "eltptr");
+    Builder->CreateBr(ContBB);
+
+    Builder->SetInsertPoint(ContBB);
+    PHINode *Addr = Builder->CreatePHI(PtrTy, 2, "eltaddr");
+    Addr->addIncoming(EltPtr, InBoundsBB);
+    Addr->addIncoming(Slot, FailBB);
+    return Addr;
+}
+
+Value *IndexExprAST::codegen(CompilerSession &S, Value *IndexV) {
+    Value *Array = S.loadVariable(this->Array);
+    if (!Array)
+        return nullptr;
+    Value *Addr = S.emitElementAddress(Array, IndexV);
+    if (!Addr)
+        return nullptr;
+    return S.Builder->CreateLoad(S.Builder->getDoubleTy(), Addr,
+                                 S.Symbols.getName(this->Array) + ".elt");
+}
+
+// codegenAssign - Store the value of the RHS to the variable or element on
+// the left, and give it back as the value of the assignment
+Value *BinaryExprAST::codegenAssign(CompilerSession &S, Value *Val, Value *IndexV) {
+    // an element, as in "a[i] = ..."
+    if (auto *Elt = dyn_cast<IndexExprAST>(LHS)) {
+        Value *Array = S.loadVariable(Elt->getArray());
+        if (!Array)
+            return nullptr;
+        Value *Addr = S.emitElementAddress(Array, IndexV);
+        Value *EltV = Addr ? S.convertTo(Val, S.Builder->getDoubleTy()) : nullptr;
+        if (!EltV)
+            return nullptr;
+        S.Builder->CreateStore(EltV, Addr);
+        S.forgetEmitted();
+        return Val;
+    }
+
+    // otherwise the LHS has to be a variable, as in "x = ..."
+    auto *LHSE = dyn_cast<VariableExprAST>(LHS);
+    if (!LHSE)
+        return S.LogErrorV("destination of '=' must be a variable or an element");
+    AllocaInst *Variable = S.NamedValues.lookup(LHSE->getName());
+    if (!Variable)
+        return S.LogErrorV("Unknown variable name");
+    if (!S.storeToSlot(Val, Variable))
+        return nullptr;
+    S.forgetEmitted();
+    return Val;
+}
+
+// emitParForBody - Outline the body of L into a new function,
+//
+//   double body(ptr ctx, i64 lo, i64 hi)
+//
+// that runs iterations lo to hi and reduces their values. The loop variable
+// is lo + k for an integer loop and Start + k for a double one, where Start
+// comes from the first field of ctx; the variables of Captures come from the
+// fields after it. Every iteration gets a copy of each of them as it was
+// before the loop, so an assignment in one does not reach any other. Returns
+// null if the body fails to generate.
+Function *CompilerSession::emitParForBody(const ParForExprAST &L, Type *VarTy,
+                                          StructType *CtxTy,
+                                          ArrayRef<SymbolID> Captures) {
+    Type *DoubleTy = Builder->getDoubleTy(), *I64Ty = Builder->getInt64Ty();
+    Function *Parent = Builder->GetInsertBlock()->getParent();
+    FunctionType *FT = FunctionType::get(
+        DoubleTy, {PointerType::getUnqual(*TheContext), I64Ty, I64Ty}, false);
+    Function *F = Function::Create(FT, Function::InternalLinkage,
+                                   Parent->getName() + ".parfor", TheModule.get());
+    Value *Ctx = F->getArg(0), *Lo = F->getArg(1), *Hi = F->getArg(2);
+    Ctx->setName("ctx");
+    Lo->setName("lo");
+    Hi->setName("hi");
+
+    // the function being generated is put aside meanwhile
+    auto SavedIP = Builder->saveIP();
+    DenseMap<SymbolID, AllocaInst *> OuterValues;
+    OuterValues.swap(NamedValues);
+    SmallVector<ValueScope, 4> OuterScopes;
+    OuterScopes.swap(ValueScopes);
+    resetValueScopes();
+
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", F));
+    AllocaInst *Acc = CreateEntryBlockAlloca(F, "acc", DoubleTy);
+    AllocaInst *K = CreateEntryBlockAlloca(F, "k", I64Ty);
+    Builder->CreateStore(ConstantFP::get(DoubleTy, L.getOp() == '*' ? 1.0 : 0.0), Acc);
+    Builder->CreateStore(Lo, K);
+    SmallVector<Value *, 8> Fields;
+    for (unsigned I = 0, E = CtxTy->getNumElements(); I != E; ++I)
+        Fields.push_back(Builder->CreateLoad(CtxTy->getElementType(I),
+                                             Builder->CreateStructGEP(CtxTy, Ctx, I)));
+    // the slots are the parfor's own, the variable first, then the captures
+    SmallVector<AllocaInst *, 8> Slots;
+    Slots.push_back(createSlot(&L, 0, Symbols.getName(L.getVarName()), VarTy));
+    for (unsigned I = 0, E = Captures.size(); I != E; ++I) {
+        Slots.push_back(createSlot(&L, I + 1, Symbols.getName(Captures[I]),
+                                   Fields[I + 1]->getType()));
+        NamedValues[Captures[I]] = Slots.back();
+    }
+    NamedValues[L.getVarName()] = Slots[0];
+    // the runtime never hands out an empty range, but with the loop guarded
+    // by its bound, IRCE can take the bounds checks out of it
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", F);
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop");
+    Builder->CreateCondBr(Builder->CreateICmpSLT(Lo, Hi, "nonempty"), LoopBB, AfterBB);
+
+    Builder->SetInsertPoint(LoopBB);
+    Value *KV = Builder->CreateLoad(I64Ty, K, "k");
+    Value *Var = VarTy->isIntegerTy()
+        ? KV
+        : Builder->CreateFAdd(Fields[0], Builder->CreateSIToFP(KV, DoubleTy), "start.k");
+    bool OK = storeToSlot(Var, Slots[0]);
+    for (unsigned I = 0, E = Captures.size(); OK && I != E; ++I)
+        OK = storeToSlot(Fields[I + 1], Slots[I + 1]);
+    Value *V = OK ? L.getBody()->codegen(*this) : nullptr;
+    if (V && L.getOp()) {
+        V = convertTo(V, DoubleTy);
+        if (V) {
+            Value *AccV = Builder->CreateLoad(DoubleTy, Acc, "acc");
+            Builder->CreateStore(L.getOp() == '*' ? Builder->CreateFMul(AccV, V, "acc")
+                                                  : Builder->CreateFAdd(AccV, V, "acc"),
+                                 Acc);
+        }
+    }
+    if (V) {
+        Value *Next = Builder->CreateNSWAdd(KV, Builder->getInt64(1), "nextk");
+        Builder->CreateStore(Next, K);
+        Builder->CreateCondBr(Builder->CreateICmpSLT(Next, Hi, "loopcond"), LoopBB, AfterBB);
+        AfterBB->insertInto(F);
+        Builder->SetInsertPoint(AfterBB);
+        Builder->CreateRet(Builder->CreateLoad(DoubleTy, Acc, "acc"));
+    }
+
+    Builder->restoreIP(SavedIP);
+    NamedValues.swap(OuterValues);
+    ValueScopes.swap(OuterScopes);
+    // a slot that turned out too narrow sends the whole function round again
+    if (!V || NeedsRetry) {
+        // the entry block branches to the exit block, so it goes too
+        if (!AfterBB->getParent())
+            AfterBB->insertInto(F);
+        deleteFunctionBody(F);
+        F->eraseFromParent();
+        return nullptr;
+    }
+    verifyFunction(*F);
+    TheFPM->run(*F, *TheFAM);
+    return F;
+}
+
+// codegen - Outline the body, and hand it to the runtime along with the
+// variables it reads, to run on the pool. The loop runs from Start to below
+// End, counting in integers if both are and in doubles from Start if not.
+Value *ParForExprAST::codegen(CompilerSession &S, Value *StartV, Value *EndV) {
+    IRBuilder<> &B = *S.Builder;
+    Type *I64Ty = B.getInt64Ty();
+    Type *VarTy = S.joinTypes(StartV->getType(), EndV->getType());
+    if (VarTy && VarTy->isIntegerTy())
+        VarTy = I64Ty;
+    if (!VarTy || !(VarTy->isIntegerTy() || VarTy->isDoubleTy()))
+        return S.LogErrorV("parfor bounds must be numbers");
+    if (!(StartV = S.convertTo(StartV, VarTy)) || !(EndV = S.convertTo(EndV, VarTy)))
+        return nullptr;
+    Value *Begin = StartV, *End = EndV;
+    if (VarTy->isDoubleTy()) {
+        // iterations 0 up to the number of them, which is 0 for NaN
+        Begin = B.getInt64(0);
+        Value *Count = B.CreateUnaryIntrinsic(Intrinsic::ceil,
+                                              B.CreateFSub(EndV, StartV, "span"));
+        End = B.CreateIntrinsic(Intrinsic::fptosi_sat, {I64Ty, VarTy}, {Count},
+                                nullptr, "count");
+    }
+
+    // the variables the body refers to, as far as they are in scope here; the
+    // rest are the loop's own, or host arrays, which the body finds itself
+    SmallSetVector<SymbolID, 8> Captures;
+    auto Capture = [&](SymbolID Var) {
+        if (Var != VarName && S.NamedValues.count(Var))
+            Captures.insert(Var);
+    };
+    SmallVector<ExprAST *, 32> Work = {Body};
+    SmallPtrSet<ExprAST *, 32> Visited;
+    while (!Work.empty()) {
+        ExprAST *N = Work.pop_back_val();
+        if (!Visited.insert(N).second)
+            continue;
+        if (auto *VE = dyn_cast<VariableExprAST>(N))
+            Capture(VE->getName());
+        else if (auto *Elt = dyn_cast<IndexExprAST>(N))
+            Capture(Elt->getArray());
+        N->forEachOperand([&](ExprAST *Op) { Work.push_back(Op); });
+    }
+    SmallVector<Value *, 8> Fields = {StartV};
+    SmallVector<Type *, 8> FieldTys = {VarTy};
+    for (SymbolID Var : Captures) {
+        Fields.push_back(S.loadVariable(Var));
+        FieldTys.push_back(Fields.back()->getType());
+    }
+    StructType *CtxTy = StructType::get(*S.TheContext, FieldTys);
+
+    Function *BodyF = S.emitParForBody(*this, VarTy, CtxTy, Captures.getArrayRef());
+    if (!BodyF)
+        return nullptr;
+
+    Function *TheFunction = B.GetInsertBlock()->getParent();
+    AllocaInst *Ctx = CreateEntryBlockAlloca(TheFunction, "parfor.ctx", CtxTy);
+    for (unsigned I = 0, E = Fields.size(); I != E; ++I)
+        B.CreateStore(Fields[I], B.CreateStructGEP(CtxTy, Ctx, I));
+    Type *PtrTy = PointerType::getUnqual(*S.TheContext);
+    FunctionCallee RunFn = S.TheModule->getOrInsertFunction(
+        ParForName, B.getDoubleTy(), PtrTy, PtrTy, I64Ty, I64Ty, B.getInt32Ty());
+    Value *V = B.CreateCall(RunFn, {BodyF, Ctx, Begin, End, B.getInt32(Op)},
+                            Op ? "parfortmp" : "");
+    // the body may have stored to any array it can reach
+    S.forgetEmitted();
+    // without a reduce, a parfor is 0 like a for
+    return Op ? V : S.getConstant(0.0);
+}
+
+Value *CompilerSession::emitArith(char Op, Value *L, Value *R, const Twine &Name) {
+    Type *Ty = joinTypes(L->getType(), R->getType());
+    // arithmetic on truth values counts them as 0 and 1
+    if (Ty && Ty->isIntegerTy(1))
+        Ty = IntTypes ? Builder->getInt64Ty() : Builder->getDoubleTy();
+    if (!(L = convertTo(L, Ty)) || !(R = convertTo(R, Ty)))
+        return nullptr;
+    bool FP = Ty->isFPOrFPVectorTy();
+    switch (Op) {
+        case '+':
+            return FP ? Builder->CreateFAdd(L, R, Name) : Builder->CreateAdd(L, R, Name);
+        case '-':
+            return FP ? Builder->CreateFSub(L, R, Name) : Builder->CreateSub(L, R, Name);
+        default:
+            return FP ? Builder->CreateFMul(L, R, Name) : Builder->CreateMul(L, R, Name);
+    }
+}
+
+Value *BinaryExprAST::codegen(CompilerSession &S, Value *L, Value *R) {
+    switch(Op) {
+        case '+': 
+            return S.emitArith(Op, L, R, "addtmp");
+        case '-':
+            return S.emitArith(Op, L, R, "subtmp");
+        case '*':
+            return S.emitArith(Op, L, R, "multmp");
+        case '<': {
+            // the result stays a bool, until something needs it as a number
+            Type *Ty = S.joinTypes(L->getType(), R->getType());
+            if (Ty && Ty->isIntegerTy())
+                Ty = S.Builder->getInt64Ty();
+            if (!(L = S.convertTo(L, Ty)) || !(R = S.convertTo(R, Ty)))
+                return nullptr;
+            if (Ty->isIntegerTy())
+                return S.Builder->CreateICmpSLT(L, R, "cmptmp");
+            Value *Cmp = S.Builder->CreateFCmpULT(L, R, "cmptmp");
+            // there is no branching on a vector of bools, so each lane gets
+            // 1.0 or 0.0 right away
+            if (Ty->isVectorTy())
+                return S.Builder->CreateUIToFP(Cmp, Ty, "booltmp");
+            return Cmp;
+        }
+        default:
+            return S.LogErrorV("invalid binary operator");
+    }
+}
+
+// resolveCallee - Find the function being called and check the arity, before
+// any code is generated for the arguments
+Function *CallExprAST::resolveCallee(CompilerSession &S) {
+    // look up the name in the global module table
+    Function *CalleeF = S.getFunction(Callee);
+    if (!CalleeF)
+        return (Function *)S.LogErrorV("Unkown function referenced");
+
+    // If argument mismatch error 
+    if (S.FunctionProtos.find(Callee)->second->getArgs().size() != NumArgs)
+        return (Function *)S.LogErrorV("Incorrect # arguments passed");
+    return CalleeF;
+}
+
+Value *CallExprAST::codegen(CompilerSession &S, Function *CalleeF,
+                            ArrayRef<Value *> ArgsV) {
+    // a C math function is the intrinsic, so it folds and vectorizes like
+    // any other operation; given a vector, it works lane by lane
+    if (Intrinsic::ID ID = S.MathExterns.lookup(Callee)) {
+        Type *Ty = S.Builder->getDoubleTy();
+        for (Value *V : ArgsV)
+            if (V->getType()->isVectorTy())
+                Ty = V->getType();
+        SmallVector<Value *, 2> Args;
+        for (Value *V : ArgsV) {
+            Args.push_back(S.convertTo(V, Ty));
+            if (!Args.back())
+                return nullptr;
+        }
+        return S.Builder->CreateIntrinsic(ID, {Ty}, Args, nullptr, "calltmp");
+    }
+    const PrototypeAST &P = *S.FunctionProtos.find(Callee)->second;
+    // integer arguments only, as in a counting loop, go to the callee's
+    // integer specialization if it has one
+    if (S.IntSpecializations.count(Callee) &&
+        all_of(ArgsV, [](Value *V) {
+            return V->getType()->isIntegerTy() || V->getType()->isStructTy();
+        }))
+        CalleeF = S.getSpecialization(Callee);
+    SmallVector<Value *, 8> Args;
+    bool PassesArrays = false;
+    auto ParamIt = CalleeF->arg_begin();
+    for (unsigned I = 0; I != NumArgs; ++I) {
+        if (P.isArrayArg(I)) {
+            if (!ArgsV[I]->getType()->isStructTy())
+                return S.LogErrorV("expected an array");
+            Args.push_back(S.Builder->CreateExtractValue(ArgsV[I], 0));
+            Args.push_back(S.Builder->CreateExtractValue(ArgsV[I], 1));
+            ParamIt += 2;
+            PassesArrays = true;
+            continue;
+        }
+        Args.push_back(S.convertTo(ArgsV[I], (ParamIt++)->getType()));
+        if (!Args.back())
+            return nullptr;
+    }
+    CallInst *V = S.Builder->CreateCall(CalleeF, Args, "calltmp");
+    V->setCallingConv(CalleeF->getCallingConv());
+    if (S.TailCalls.count(this))
+        V->setTailCall();
+    // anything but a pure function may have stored to an array it was
+    // given, or to one of the host's
+    if (!S.PureFunctions.count(Callee) && (PassesArrays || !S.HostArrays.empty()))
+        S.forgetEmitted();
+    return V;
+}
+
+// laneOf - The lane E names, if it is a constant below NumLanes, or -1
+static int laneOf(const ExprAST *E, unsigned NumLanes) {
+    auto *N = dyn_cast<NumberExprAST>(E);
+    if (!N || N->getVal() < 0 || N->getVal() >= NumLanes ||
+        N->getVal() != (double)(unsigned)N->getVal())
+        return -1;
+    return (int)N->getVal();
+}
+
+// codegenBuiltin - Generate a call to a builtin inline. The vectors they take
+// and give are <N x double>, so the vector operations go straight to vector
+// instructions:
+//
+//   vec4(x) vec8(x)               x in every lane
+//   vec4(x0, ..., x3)             one value per lane, likewise for vec8
+//   lane(v, i)                    lane i of v
+//   insertlane(v, i, x)           v with lane i replaced by x
+//   shuffle(a, b, m0, ..., mK-1)  K lanes, each lane mj of a, or of b from
+//                                 lane N on; K is 4 or 8
+//   hadd(v) hmin(v) hmax(v)       the sum, least and greatest of the lanes
+//   len(a)                        the number of elements of the array a
+//
+// Lanes have to be constants.
+Value *CallExprAST::codegenBuiltin(CompilerSession &S, ArrayRef<Value *> ArgsV) {
+    IRBuilder<> &B = *S.Builder;
+    Type *DoubleTy = B.getDoubleTy();
+    // the vector that all but the constructors work on
+    auto *VecTy = ArgsV.empty() ? nullptr : dyn_cast<FixedVectorType>(ArgsV[0]->getType());
+    switch (Callee) {
+        case sym_vec4:
+        case sym_vec8: {
+            unsigned Width = Callee == sym_vec4 ? 4 : 8;
+            if (NumArgs != 1 && NumArgs != Width)
+                return S.LogErrorV("Incorrect # arguments passed");
+            auto *Ty = FixedVectorType::get(DoubleTy, Width);
+            if (NumArgs == 1)
+                return S.convertTo(ArgsV[0], Ty);
+            Value *V = PoisonValue::get(Ty);
+            for (unsigned I = 0; I != Width; ++I) {
+                Value *Elt = S.convertTo(ArgsV[I], DoubleTy);
+                if (!Elt)
+                    return nullptr;
+                V = B.CreateInsertElement(V, Elt, I, "vectmp");
+            }
+            return V;
+        }
+        case sym_lane:
+        case sym_insertlane: {
+            if (NumArgs != (Callee == sym_lane ? 2u : 3u))
+                return S.LogErrorV("Incorrect # arguments passed");
+            if (!VecTy)
+                return S.LogErrorV("expected a vector");
+            int Lane = laneOf(getArgs()[1], VecTy->getNumElements());
+            if (Lane < 0)
+                return S.LogErrorV("lane must be a constant lane of the vector");
+            if (Callee == sym_lane)
+                return B.CreateExtractElement(ArgsV[0], Lane, "lanetmp");
+            Value *Elt = S.convertTo(ArgsV[2], DoubleTy);
+            if (!Elt)
+                return nullptr;
+            return B.CreateInsertElement(ArgsV[0], Elt, Lane, "vectmp");
+        }
+        case sym_shuffle: {
+            if (NumArgs != 2 + 4 && NumArgs != 2 + 8)
+                return S.LogErrorV("Incorrect # arguments passed");
+            if (!VecTy || ArgsV[1]->getType() != VecTy)
+                return S.LogErrorV("shuffle takes two vectors of the same width");
+            SmallVector<int, 8> Mask;
+            for (ExprAST *Arg : getArgs().drop_front(2)) {
+                Mask.push_back(laneOf(Arg, 2 * VecTy->getNumElements()));
+                if (Mask.back() < 0)
+                    return S.LogErrorV("lane must be a constant lane of the vectors");
+            }
+            return B.CreateShuffleVector(ArgsV[0], ArgsV[1], Mask, "shuffletmp");
+        }
+        case sym_len: {
+            if (NumArgs != 1)
+                return S.LogErrorV("Incorrect # arguments passed");
+            if (!ArgsV[0]->getType()->isStructTy())
+                return S.LogErrorV("expected an array");
+            Value *Len = B.CreateExtractValue(ArgsV[0], 1, "len");
+            return IntTypes ? Len : B.CreateSIToFP(Len, DoubleTy, "lentmp");
+        }
+        default: {
+            if (NumArgs != 1)
+                return S.LogErrorV("Incorrect # arguments passed");
+            if (!VecTy)
+                return S.LogErrorV("expected a vector");
+            // an ordered sum, the same as adding up the lanes one by one;
+            // like minnum and maxnum, hmin and hmax pass over NaN lanes
+            if (Callee == sym_hadd)
+                return B.CreateFAddReduce(ConstantFP::getNegativeZero(DoubleTy), ArgsV[0]);
+            if (Callee == sym_hmin)
+                return B.CreateFPMinReduce(ArgsV[0]);
+            return B.CreateFPMaxReduce(ArgsV[0]);
+        }
+    }
+}
+
+FunctionType *CompilerSession::getFunctionType(const PrototypeAST &P, Type *ArgTy,
+                                               Type *RetTy) {
+    std::vector<Type *> Params;
+    for (unsigned I = 0, E = P.getArgs().size(); I != E; ++I) {
+        if (P.isArrayArg(I)) {
+            Params.push_back(PointerType::getUnqual(*TheContext));
+            Params.push_back(Builder->getInt64Ty());
+        } else {
+            Params.push_back(ArgTy);
+        }
+    }
+    return FunctionType::get(RetTy, Params, false);
+}
+
+void CompilerSession::nameArgs(Function *F, const PrototypeAST &P) {
+    auto ArgIt = F->arg_begin();
+    for (unsigned I = 0, E = P.getArgs().size(); I != E; ++I) {
+        StringRef Name = Symbols.getName(P.getArgs()[I]);
+        (ArgIt++)->setName(Name);
+        if (P.isArrayArg(I))
+            (ArgIt++)->setName(Name + ".len");
+    }
+}
+
+Function *PrototypeAST::codegen(CompilerSession &S) {
+    // make the function type: double(double, double), with a ptr and an i64
+    // for each array
+    Type *DoubleTy = Type::getDoubleTy(*S.TheContext);
+    FunctionType *FT = S.getFunctionType(*this, DoubleTy, DoubleTy);
+
+    // an extern again of a function the module declares already only
+    // changes what is known of it
+    Function *F = S.TheModule->getFunction(S.Symbols.getName(Name));
+    if (F && F->isDeclaration() && F->getFunctionType() == FT) {
+        F->setAttributes(AttributeList());
+        S.addFunctionAttrs(F, S.FunctionInfos.lookup(Name));
+        return F;
+    }
+    F = Function::Create(FT, Function::ExternalLinkage, S.Symbols.getName(Name),
+                         S.TheModule.get());
+    // set names for all arguments 
+    S.nameArgs(F, *this);
+    S.addFunctionAttrs(F, S.FunctionInfos.lookup(Name));
+    return F;
+}
+
+Function *FunctionAST::codegen(CompilerSession &S) {
+    // Transfer ownership of the prototype to the FunctionProtos map, but keep
+    // a reference to it for use below. The prototype of an earlier extern or
+    // definition of the name goes back if this one fails.
+    auto &P = *Proto;
+    SymbolID Name = P.getName();
+    std::unique_ptr<PrototypeAST> Earlier = std::move(S.FunctionProtos[Name]);
+    S.FunctionProtos[Name] = std::move(Proto);
+    auto RestoreEarlier = [&] {
+        if (Earlier)
+            S.FunctionProtos[Name] = std::move(Earlier);
+        else
+            S.FunctionProtos.erase(Name);
+    };
+
+    // this also picks up an existing function from a previous 'extern' declaration
+    Function *TheFunction = S.getFunction(Name);
+    IRBuilderBase::FastMathFlagGuard FMFGuard(*S.Builder);
+    S.Builder->setFastMathFlags(S.getFastMathFlags(Precision));
+    if (!TheFunction) {
+        RestoreEarlier();
+        return nullptr;
+    }
+    if (!TheFunction->empty()) {
+        S.LogError("Function cannot be redefined");
+        RestoreEarlier();
+        return nullptr;
+    }
+    // what an extern before it said no longer holds, the body says
+    unsigned Info = S.FunctionInfos.lookup(P.getName());
+    TheFunction->setAttributes(AttributeList());
+    S.addFunctionAttrs(TheFunction, Info);
+
+    // a memoized function is a cache, in front of a function of its own that
+    // has the body; only the cache calls that, so it can use fastcc
+    Function *BodyF = TheFunction;
+    if (Memo) {
+        BodyF = Function::Create(TheFunction->getFunctionType(),
+                                 Function::InternalLinkage,
+                                 TheFunction->getName() + ".body", S.TheModule.get());
+        BodyF->setCallingConv(CallingConv::Fast);
+        S.nameArgs(BodyF, P);
+        S.addFunctionAttrs(BodyF, Info);
+    }
+    Value *RetVal = S.emitFunctionBody(BodyF, P, Body);
+    if (RetVal)
+        RetVal = S.convertTo(RetVal, BodyF->getReturnType());
+    if (RetVal) {
+        // finish off the function 
+        S.Builder->CreateRet(RetVal);
+
+        // Validate the generated code, checking for consistency
+        verifyFunction(*BodyF);
+
+        // optimize the function
+        S.TheFPM->run(*BodyF, *S.TheFAM);
+
+        // the cache is keyed on the bits of doubles, so there is no integer
+        // specialization to go round it
+        if (Memo) {
+            S.emitMemoCache(TheFunction, BodyF);
+            verifyFunction(*TheFunction);
+            S.TheFPM->run(*TheFunction, *S.TheFAM);
+            return TheFunction;
+        }
+
+        // with no numbers to take, the specialization would be no different
+        bool HasNumbers = false;
+        for (unsigned I = 0, E = P.getArgs().size(); I != E; ++I)
+            HasNumbers |= !P.isArrayArg(I);
+        if (IntTypes && HasNumbers)
+            S.emitSpecialization(P, Body);
+        return TheFunction;
+    }
+    if (BodyF != TheFunction) {
+        S.deleteFunctionBody(BodyF);
+        BodyF->eraseFromParent();
+    }
+    S.deleteFunctionBody(TheFunction);
+    // with an extern before it, calls may have been generated to the
+    // declaration already; it stays, with none of the body's attributes
+    if (Earlier)
+        TheFunction->setAttributes(AttributeList());
+    else
+        TheFunction->eraseFromParent();
+    RestoreEarlier();
+    return nullptr;
+}
+
+
+
+// precompiled scripts
+//
+// A .kbc file holds a script already parsed and simplified, for toy to load
+// without lexing or parsing any of it. It is meant to be mapped and read in
+// place, so it is a header followed by flat tables of little-endian fields,
+// none of which need any alignment:
+//
+//   Header
+//   StringEntry[NumStrings]    the name of each symbol the script uses
+//   Node[NumNodes]             expression nodes, each item's in post-order
+//   ulittle32_t[NumOperands]   call arguments and prototype parameters
+//   Prototype[NumPrototypes]
+//   Item[NumItems]             definitions, externs and expressions, in order
+//   char[StringDataSize]       the characters of the string table
+//
+// Symbols are indices into the string table. A node refers to its operands by
+// their index from the first node of its item; operands always come first,
+// and the body of an item is its last node.
+namespace kbc {
+const char Magic[4] = {'K', 'B', 'C', '\0'};
+const uint32_t Version = 2;
+
+struct Header {
+    char Magic[4];
+    support::ulittle32_t Version;
+    support::ulittle32_t NumStrings;
+    support::ulittle32_t NumNodes;
+    support::ulittle32_t NumOperands;
+    support::ulittle32_t NumPrototypes;
+    support::ulittle32_t NumItems;
+    support::ulittle32_t StringDataSize;
+};
+
+struct StringEntry {
+    support::ulittle32_t Offset;
+    support::ulittle32_t Size;
+};
+
+struct Node {
+    uint8_t Kind;   // an ExprAST::ExprKind
+    uint8_t Op;     // EK_Binary: the operator, EK_ParFor: the reduce operator
+    uint8_t Shared; // EK_Call: CallExprAST::isShared()
+    uint8_t Reserved;
+    // EK_Variable: the symbol, EK_Binary: the LHS, EK_Call: the callee,
+    // EK_If: the condition, EK_For and EK_ParFor: the loop variable, EK_Var:
+    // the body, EK_Index: the array
+    support::ulittle32_t A;
+    // EK_Number: the bits of the value, EK_Binary: the RHS, EK_Index: the
+    // index, EK_If: the then
+    // branch in the low half and the else branch in the high, EK_Call,
+    // EK_For and EK_ParFor: the first operand in the low half and the number
+    // of operands in the high; a for has start, end, optional step and body,
+    // in that order, a parfor start, end and body, EK_Var: the same, with
+    // each variable's symbol followed by its initializer, or NoInit if it
+    // has none
+    support::ulittle64_t B;
+};
+
+const uint32_t NoInit = ~0u;
+
+struct Prototype {
+    support::ulittle32_t Name;
+    support::ulittle32_t FirstParam; // in the operand table
+    support::ulittle32_t NumParams;
+};
+
+// set on a parameter's symbol in the operand table if it is an array
+const uint32_t ArrayParam = 1u << 31;
+
+enum ItemKind : uint32_t {
+    IK_Definition, IK_Extern, IK_Expression, IK_MemoDefinition, IK_PureExtern
+};
+
+struct Item {
+    support::ulittle32_t Kind;
+    support::ulittle32_t Proto;     // IK_*Definition, IK_*Extern
+    support::ulittle32_t FirstNode; // IK_*Definition, IK_Expression
+    support::ulittle32_t NumNodes;
+    support::ulittle32_t Precision; // IK_*Definition: its FPMode
+};
+} // namespace kbc
+
+// KBCWriter - Builds up the tables of a .kbc file as items are added
+class KBCWriter {
+    const SymbolTable &Symbols;
+    DenseMap<SymbolID, uint32_t> StringIndex;
+    std::vector<kbc::StringEntry> Strings;
+    std::string StringData;
+    std::vector<kbc::Node> Nodes;
+    std::vector<support::ulittle32_t> Operands;
+    std::vector<kbc::Prototype> Protos;
+    std::vector<kbc::Item> Items;
+
+    uint32_t addString(SymbolID Sym);
+    uint32_t addPrototype(const PrototypeAST &P);
+    void addBody(kbc::Item &I, ExprAST *Body);
+
+    public: 
+        KBCWriter(const SymbolTable &Symbols) : Symbols(Symbols) {}
+        void addDefinition(const FunctionAST &F);
+        void addExtern(const PrototypeAST &P, bool Pure);
+        void addTopLevelExpr(ExprAST *E);
+        void write(raw_ostream &OS) const;
+};
+
+uint32_t KBCWriter::addString(SymbolID Sym) {
+    auto Res = StringIndex.try_emplace(Sym, Strings.size());
+    if (Res.second) {
+        StringRef Name = Symbols.getName(Sym);
+        Strings.push_back({support::ulittle32_t(StringData.size()),
+                           support::ulittle32_t(Name.size())});
+        StringData += Name;
+    }
+    return Res.first->second;
+}
+
+uint32_t KBCWriter::addPrototype(const PrototypeAST &P) {
+    kbc::Prototype KP;
+    KP.Name = addString(P.getName());
+    KP.FirstParam = Operands.size();
+    KP.NumParams = P.getArgs().size();
+    for (unsigned I = 0, E = P.getArgs().size(); I != E; ++I)
+        Operands.push_back(support::ulittle32_t(
+            addString(P.getArgs()[I]) | (P.isArrayArg(I) ? kbc::ArrayParam : 0)));
+    Protos.push_back(KP);
+    return Protos.size() - 1;
+}
+
+// addBody - Flatten the DAG rooted at Body into the node table, in post-order
+// and each node once
+void KBCWriter::addBody(kbc::Item &I, ExprAST *Body) {
+    I.FirstNode = Nodes.size();
+    DenseMap<ExprAST *, uint32_t> Index;
+    SmallVector<std::pair<ExprAST *, bool>, 32> Work = {{Body, false}};
+    while (!Work.empty()) {
+        auto [E, OperandsDone] = Work.pop_back_val();
+        if (Index.count(E))
+            continue;
+        if (!OperandsDone) {
+            Work.push_back({E, true});
+            SmallVector<ExprAST *, 4> Ops;
+            E->forEachOperand([&](ExprAST *Op) { Ops.push_back(Op); });
+            for (ExprAST *Op : reverse(Ops))
+                Work.push_back({Op, false});
+            continue;
+        }
+
+        kbc::Node N = {};
+        N.Kind = E->getKind();
+        switch (E->getKind()) {
+            case ExprAST::EK_Number:
+                N.B = bit_cast<uint64_t>(cast<NumberExprAST>(E)->getVal());
+                break;
+            case ExprAST::EK_Variable:
+                N.A = addString(cast<VariableExprAST>(E)->getName());
+                break;
+            case ExprAST::EK_Binary: {
+                auto *B = cast<BinaryExprAST>(E);
+                N.Op = B->getOp();
+                N.A = Index[B->getLHS()];
+                N.B = Index[B->getRHS()];
+                break;
+            }
+            case ExprAST::EK_Call: {
+                auto *C = cast<CallExprAST>(E);
+                N.Shared = C->isShared();
+                N.A = addString(C->getCallee());
+                N.B = Operands.size() | uint64_t(C->getArgs().size()) << 32;
+                for (ExprAST *Arg : C->getArgs())
+                    Operands.push_back(support::ulittle32_t(Index[Arg]));
+                break;
+            }
+            case ExprAST::EK_If: {
+                auto *If = cast<IfExprAST>(E);
+                N.A = Index[If->getCond()];
+                N.B = Index[If->getThen()] | uint64_t(Index[If->getElse()]) << 32;
+                break;
+            }
+            case ExprAST::EK_For: {
+                auto *L = cast<ForExprAST>(E);
+                N.A = addString(L->getVarName());
+                uint64_t First = Operands.size();
+                L->forEachOperand([&](ExprAST *Op) {
+                    Operands.push_back(support::ulittle32_t(Index[Op]));
+                });
+                N.B = First | (Operands.size() - First) << 32;
+                break;
+            }
+            case ExprAST::EK_ParFor: {
+                auto *L = cast<ParForExprAST>(E);
+                N.Op = L->getOp();
+                N.A = addString(L->getVarName());
+                uint64_t First = Operands.size();
+                L->forEachOperand([&](ExprAST *Op) {
+                    Operands.push_back(support::ulittle32_t(Index[Op]));
+                });
+                N.B = First | (Operands.size() - First) << 32;
+                break;
+            }
+            case ExprAST::EK_Var: {
+                auto *V = cast<VarExprAST>(E);
+                N.A = Index[V->getBody()];
+                uint64_t First = Operands.size();
+                for (const VarBinding &B : V->getBindings()) {
+                    Operands.push_back(support::ulittle32_t(addString(B.Name)));
+                    Operands.push_back(support::ulittle32_t(B.Init ? Index[B.Init] : kbc::NoInit));
+                }
+                N.B = First | (Operands.size() - First) << 32;
+                break;
+            }
+            case ExprAST::EK_Index: {
+                auto *Elt = cast<IndexExprAST>(E);
+                N.A = addString(Elt->getArray());
+                N.B = Index[Elt->getIndex()];
+                break;
+            }
+        }
+        Index[E] = Nodes.size() - I.FirstNode;
+        Nodes.push_back(N);
+    }
+    I.NumNodes = Nodes.size() - I.FirstNode;
+}
+
+void KBCWriter::addDefinition(const FunctionAST &F) {
+    kbc::Item I = {};
+    I.Kind = F.isMemo() ? kbc::IK_MemoDefinition : kbc::IK_Definition;
+    I.Precision = F.getPrecision();
+    I.Proto = addPrototype(F.getProto());
+    addBody(I, F.getBody());
+    Items.push_back(I);
+}
+
+void KBCWriter::addExtern(const PrototypeAST &P, bool Pure) {
+    kbc::Item I = {};
+    I.Kind = Pure ? kbc::IK_PureExtern : kbc::IK_Extern;
+    I.Proto = addPrototype(P);
+    Items.push_back(I);
+}
+
+void KBCWriter::addTopLevelExpr(ExprAST *E) {
+    kbc::Item I = {};
+    I.Kind = kbc::IK_Expression;
+    addBody(I, E);
+    Items.push_back(I);
+}
+
+void KBCWriter::write(raw_ostream &OS) const {
+    kbc::Header H;
+    memcpy(H.Magic, kbc::Magic, sizeof(H.Magic));
+    H.Version = kbc::Version;
+    H.NumStrings = Strings.size();
+    H.NumNodes = Nodes.size();
+    H.NumOperands = Operands.size();
+    H.NumPrototypes = Protos.size();
+    H.NumItems = Items.size();
+    H.StringDataSize = StringData.size();
+
+    auto WriteTable = [&](const auto &Table) {
+        OS.write(reinterpret_cast<const char *>(Table.data()),
+                 Table.size() * sizeof(Table[0]));
+    };
+    OS.write(reinterpret_cast<const char *>(&H), sizeof(H));
+    WriteTable(Strings);
+    WriteTable(Nodes);
+    WriteTable(Operands);
+    WriteTable(Protos);
+    WriteTable(Items);
+    OS << StringData;
+}
+
+
+
+// top-level parsing and JIT driver
+
+// how much JIT state a long stream of items builds up
+static cl::opt<unsigned> DefBatch("def-batch",
+                                  cl::desc("Number of definitions to compile "
+                                           "into each JIT module"),
+                                  cl::init(1));
+static cl::opt<unsigned> InlineDefSize(
+    "inline-def-size",
+    cl::desc("Keep the IR of definitions of up to this many instructions, for "
+             "later modules to inline (0 turns inlining across items off)"),
+    cl::init(64));
+static cl::opt<unsigned> MaxLiveDefs(
+    "max-live-defs",
+    cl::desc("Evict the least recently used definitions nothing else calls "
+             "once the JIT holds more than this many (default: keep all)"),
+    cl::init(0));
+static cl::opt<unsigned> RSSInterval("report-rss",
+                                     cl::desc("Report the resident set size "
+                                              "every N items"),
+                                     cl::value_desc("N"), cl::init(0));
+
+// collectCallees - Add every function called in E to Out, once each
+static void collectCallees(ExprAST *E, std::vector<SymbolID> &Out) {
+    SmallVector<ExprAST *, 32> Work = {E};
+    SmallPtrSet<ExprAST *, 32> Visited;
+    DenseSet<SymbolID> Seen;
+    while (!Work.empty()) {
+        ExprAST *N = Work.pop_back_val();
+        if (!Visited.insert(N).second)
+            continue;
+        if (auto *C = dyn_cast<CallExprAST>(N))
+            if (Seen.insert(C->getCallee()).second)
+                Out.push_back(C->getCallee());
+        N->forEachOperand([&](ExprAST *Op) { Work.push_back(Op); });
+    }
+}
+
+// inferFunctionInfo - What can be assumed of the function Self with the body
+// Body, from what it does and what is known of the functions it calls
+unsigned CompilerSession::inferFunctionInfo(ExprAST *Body, SymbolID Self) const {
+    unsigned Info = FI_ReadNone | FI_ReadOnly | FI_WillReturn | FI_NoFree;
+    SmallVector<ExprAST *, 32> Work = {Body};
+    SmallPtrSet<ExprAST *, 32> Visited;
+    while (!Work.empty()) {
+        ExprAST *N = Work.pop_back_val();
+        if (!Visited.insert(N).second)
+            continue;
+        switch (N->getKind()) {
+            case ExprAST::EK_For:
+                // may never end
+                Info &= ~FI_WillReturn;
+                break;
+            case ExprAST::EK_ParFor:
+                // hands its iterations to the threads of the runtime
+                return 0;
+            case ExprAST::EK_Index:
+                // reads an array, and calls out to the host when out of bounds
+                Info &= ~(FI_ReadNone | FI_WillReturn);
+                break;
+            case ExprAST::EK_Binary: {
+                auto *B = cast<BinaryExprAST>(N);
+                if (B->getOp() == '=' && isa<IndexExprAST>(B->getLHS()))
+                    Info &= ~FI_ReadOnly;
+                break;
+            }
+            case ExprAST::EK_Call: {
+                SymbolID Callee = cast<CallExprAST>(N)->getCallee();
+                // a call back to itself is as good as it is, if it ends
+                if (Callee == Self)
+                    Info &= ~FI_WillReturn;
+                else if (!isBuiltin(Callee))
+                    Info &= FunctionInfos.lookup(Callee);
+                break;
+            }
+            default:
+                break;
+        }
+        N->forEachOperand([&](ExprAST *Op) { Work.push_back(Op); });
+    }
+    return Info;
+}
+
+// addFunctionAttrs - Give F the attributes Info says it can have
+void CompilerSession::addFunctionAttrs(Function *F, unsigned Info) {
+    F->setDoesNotThrow();
+    if (Info & FI_ReadNone)
+        F->setDoesNotAccessMemory();
+    else if (Info & FI_ReadOnly)
+        F->setOnlyReadsMemory();
+    if (Info & FI_WillReturn)
+        F->addFnAttr(Attribute::WillReturn);
+    if (Info & FI_NoFree)
+        F->addFnAttr(Attribute::NoFree);
+}
+
+// callsOnlyPure - True if Body, the body of Self, only calls builtins, pure
+// functions and Self, and has no array elements to read or store
+bool CompilerSession::callsOnlyPure(ExprAST *Body, SymbolID Self) const {
+    SmallVector<ExprAST *, 32> Work = {Body};
+    SmallPtrSet<ExprAST *, 32> Visited;
+    while (!Work.empty()) {
+        ExprAST *N = Work.pop_back_val();
+        if (!Visited.insert(N).second)
+            continue;
+        if (isa<IndexExprAST>(N))
+            return false;
+        if (auto *C = dyn_cast<CallExprAST>(N))
+            if (!isBuiltin(C->getCallee()) && C->getCallee() != Self &&
+                !PureFunctions.count(C->getCallee()))
+                return false;
+        N->forEachOperand([&](ExprAST *Op) { Work.push_back(Op); });
+    }
+    return true;
+}
+
+CompilerSession::CompilerSession(std::shared_ptr<KaleidoscopeJIT> TheJIT)
+    : SessionPrecision(SessionFPMode), TheJIT(std::move(TheJIT)) {
+    // install standard binary operators 
+    // 1 is lowest precedence 
+    BinopPrecedence['='] = 2;
+    BinopPrecedence['<'] = 10; 
+    BinopPrecedence['+'] = 20;
+    BinopPrecedence['-'] = 20;
+    BinopPrecedence['*'] = 40; // highest
+
+    TM = ExitOnErr(this->TheJIT->createTargetMachine());
+    InitializeModuleAndManagers();
 }
 
-Value *VariableExprAST::codegen() {
-    // look this variable up in the function 
-    Value *V = NamedValues[Name]; 
-    if (!V)
-        LogErrorV("Unknown variable name"); 
-    return V;
+void CompilerSession::setFPMode(FPMode Mode) {
+    SessionPrecision = Mode == FP_Session ? SessionFPMode : Mode;
+    Builder->setFastMathFlags(getFastMathFlags(FP_Session));
 }
 
-Value *BinaryExprAST::codegen() {
-    Value *L = LHS->codegen(); 
-    Value *R = RHS->codegen(); 
-    if (!L || !R)
-        return nullptr;
-
-    switch(Op) {
-        case '+': 
-            return Builder->CreateFAdd(L, R, "addtmp");
-        case '-':
-            return Builder->CreateFSub(L, R, "subtmp");
-        case '*':
-            return Builder->CreateFMul(L, R, "multmp");
-        case '<':
-            return Builder->CreateFCmpULT(L, R, "cmptmp");
-            // convert bool 0/1 to double 0.0 or 1.0
-            return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-        default:
-            return LogErrorV("invalid binary operator");
-    }
+CompilerSession::~CompilerSession() {
+    // the chunks' trackers have to go before the JIT they belong to
+    Chunks.clear();
 }
 
-Value *CallExprAST::codegen() {
-    // look up the name in the global module table
-    Function *CalleeF = TheModule->getFunction(Callee);
-    if (!CalleeF)
-        return LogErrorV("Unkown function referenced");
-
-    // If argument mismatch error 
-    if (CalleeF->arg_size() != Args.size())
-        return LogErrorV("Incorrect # arguments passed");
+// createJIT - A JIT with the host functions generated code calls defined
+static Expected<std::unique_ptr<KaleidoscopeJIT>> createJIT() {
+    auto JIT = KaleidoscopeJIT::Create();
+    if (!JIT)
+        return JIT.takeError();
+    if (auto Err = (*JIT)->defineHostSymbol(BoundsErrorName,
+                                            (void *)&handleBoundsError))
+        return std::move(Err);
+    if (auto Err = (*JIT)->defineHostSymbol(ParForName, (void *)&runParFor))
+        return std::move(Err);
+    return JIT;
+}
 
-    std::vector<Value *>ArgsV;
-    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-        ArgsV.push_back(Args[i]->codegen());
-        if (!ArgsV.back())
-            return nullptr;
-    }
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+Expected<std::unique_ptr<CompilerSession>> CompilerSession::Create() {
+    auto JIT = createJIT();
+    if (!JIT)
+        return JIT.takeError();
+    return std::make_unique<CompilerSession>(std::move(*JIT));
 }
 
-Function *PrototypeAST::codegen() {
-    // make the function type: double(double, double)
-    std::vector<Type *>Doubles(Args.size(), Type::getDoubleTy(*TheContext));
+Function *CompilerSession::getFunction(SymbolID Name) {
+    // First, see if the function has already been added to the current module
+    if (auto *F = TheModule->getFunction(Symbols.getName(Name)))
+        return F;
 
-    FunctionType *FT = 
-        FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+    // If not, check whether we can codegen the declaration from some existing
+    // prototype
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end())
+        return FI->second->codegen(*this);
 
-    Function *F = 
-        Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
-    // set names for all arguments 
-    unsigned Idx = 0; 
-    for (auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
-    return F;
+    // If no existing prototype exists, return null
+    return nullptr;
 }
 
-Function *FunctionAST::codegen() {
-    // first, check for an existing function from a previous 'extern' declaration
-    Function *TheFunction = TheModule->getFunction(Proto->getName());
+static cl::opt<bool> BalanceChains(
+    "balance-chains",
+    cl::desc("Rebuild long chains of adds or multiplies as balanced trees, "
+             "where they may be reordered: integers, and doubles in fast mode"),
+    cl::init(false));
 
-    if(!TheFunction)
-        TheFunction = Proto->codegen();
-    if (!TheFunction)
-        return nullptr;
-    if (!TheFunction->empty())
-        return (Function *)LogErrorV("Function cannot be redefined");
-    // Crete a new basic block to start insertion into 
-    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
-
-    // Record the function arguments in the NamedValues map
-    NamedValues.clear(); 
-    for (auto &Arg : TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
-
-    if (Value *RetVal = Body->codegen()) {
-        // finish off the function 
-        Builder->CreateRet(RetVal);
+// BalanceChainsPass - Tree height reduction. a+b+c+d parses as ((a+b)+c)+d,
+// a chain where each add waits for the one before, so its latency grows with
+// its length. Where the operation may be reassociated, this rebuilds the
+// chain as a balanced tree, (a+b)+(c+d), whose operations at each level can
+// all run at once: the depth is log2 of the number of operands. Reassociate
+// makes trees back into chains, so this has to run after it.
+struct BalanceChainsPass : PassInfoMixin<BalanceChainsPass> {
+    // below this many operands there is too little to gain
+    static const unsigned MinOperands = 4;
 
-        // Validate the generated code, checking for consistency
-        verifyFunction(*TheFunction);
+    // isLink - Whether V is an operation of the chain Root heads, other than
+    // Root itself: the same operation, also free to be reassociated, in the
+    // same block, whose only use is the next link
+    static bool isLink(Value *V, const BinaryOperator *Root) {
+        auto *I = dyn_cast<BinaryOperator>(V);
+        return I && I->getOpcode() == Root->getOpcode() &&
+               I->getParent() == Root->getParent() && I->isAssociative() &&
+               I->hasOneUse();
+    }
 
-        // optimize the function
-        TheFPM->run(*TheFunction, *TheFAM);
+    // balance - Rebuild the chain Root heads, if it is long and deep enough
+    // to be worth it
+    static bool balance(BinaryOperator *Root) {
+        SmallVector<Value *, 16> Operands;
+        SmallVector<Instruction *, 16> Links;
+        unsigned Depth = 0;
+        // left to right, so the tree adds up the operands in the same order
+        SmallVector<std::pair<Value *, unsigned>, 16> Stack{{Root, 0}};
+        while (!Stack.empty()) {
+            auto [V, D] = Stack.pop_back_val();
+            if (V != Root && !isLink(V, Root)) {
+                Operands.push_back(V);
+                Depth = std::max(Depth, D);
+                continue;
+            }
+            auto *I = cast<Instruction>(V);
+            Links.push_back(I);
+            Stack.push_back({I->getOperand(1), D + 1});
+            Stack.push_back({I->getOperand(0), D + 1});
+        }
+        if (Operands.size() < MinOperands || Depth <= Log2_32_Ceil(Operands.size()))
+            return false;
 
-        return TheFunction;
+        // the new operations only get the flags every link had
+        IRBuilder<> B(Root);
+        if (isa<FPMathOperator>(Root)) {
+            FastMathFlags FMF = Root->getFastMathFlags();
+            for (Instruction *I : Links)
+                FMF &= I->getFastMathFlags();
+            B.setFastMathFlags(FMF);
+        }
+        while (Operands.size() > 1) {
+            SmallVector<Value *, 16> Level;
+            for (unsigned I = 0; I + 1 < Operands.size(); I += 2)
+                Level.push_back(B.CreateBinOp(Root->getOpcode(), Operands[I],
+                                              Operands[I + 1], Root->getName()));
+            if (Operands.size() % 2)
+                Level.push_back(Operands.back());
+            Operands = std::move(Level);
+        }
+        Root->replaceAllUsesWith(Operands[0]);
+        // each link is erased before the one it uses
+        for (Instruction *I : Links)
+            I->eraseFromParent();
+        return true;
     }
-    TheFunction->eraseFromParent();
-    return nullptr;
-}
 
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+        bool Changed = false;
+        for (BasicBlock &BB : F) {
+            // the ends of the chains, found before any of them changes
+            SmallVector<BinaryOperator *, 8> Roots;
+            for (Instruction &I : BB) {
+                auto *BO = dyn_cast<BinaryOperator>(&I);
+                if (!BO || !BO->isAssociative())
+                    continue;
+                switch (BO->getOpcode()) {
+                    case Instruction::Add:
+                    case Instruction::Mul:
+                    case Instruction::FAdd:
+                    case Instruction::FMul:
+                        break;
+                    default:
+                        continue;
+                }
+                auto *Next = BO->hasOneUse() ? dyn_cast<BinaryOperator>(BO->user_back())
+                                             : nullptr;
+                if (!Next || !isLink(BO, Next))
+                    Roots.push_back(BO);
+            }
+            for (BinaryOperator *Root : Roots)
+                Changed |= balance(Root);
+        }
+        if (!Changed)
+            return PreservedAnalyses::all();
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        return PA;
+    }
+};
 
+// haveVectorMathLibrary - Whether the vector versions of the math functions
+// in glibc's libmvec are there for the JIT to link against. The library is
+// loaded the first time this is asked, if it can be.
+static bool haveVectorMathLibrary(const Triple &TT) {
+    if (TT.getArch() != Triple::x86_64 || !TT.isOSLinux())
+        return false;
+    static bool Loaded = !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+    return Loaded;
+}
 
-// top-level parsing and JIT driver
+// getTargetLibraryInfo - What the target's C library offers, and the vector
+// versions of the math functions, where there are any
+static TargetLibraryInfoImpl getTargetLibraryInfo(const Triple &TT) {
+    TargetLibraryInfoImpl TLII(TT);
+    if (haveVectorMathLibrary(TT))
+        TLII.addVectorizableFunctionsFromVecLib(TargetLibraryInfoImpl::LIBMVEC_X86, TT);
+    return TLII;
+}
 
-void InitializeModuleAndManagers(void) {
+void CompilerSession::InitializeModuleAndManagers() {
     // Open a new context and module
     TheContext = std::make_unique<LLVMContext>(); 
     TheModule = std::make_unique<Module>("KaleidoscopeJIT", *TheContext);
@@ -518,19 +4177,24 @@ void InitializeModuleAndManagers(void) {
 
     // Create a new builder for the module
     Builder = std::make_unique<IRBuilder<>>(*TheContext);
+    Builder->setFastMathFlags(getFastMathFlags(FP_Session));
 
 
     // create new pass and analysis mangers
     TheFPM = std::make_unique<FunctionPassManager>();
-    TheLAM = std::make_unique<LoopAnalysisManager>(); 
-    TheFAM = std::make_unique<FunctionAnalysisManager>();
-    TheCGAM = std::make_unique<CGSCCAnalysisManager>(); 
+    // outermost first: the old managers' cached proxies still refer to the
+    // inner ones, and have to go before those do
     TheMAM = std::make_unique<ModuleAnalysisManager>();
+    TheCGAM = std::make_unique<CGSCCAnalysisManager>(); 
+    TheFAM = std::make_unique<FunctionAnalysisManager>();
+    TheLAM = std::make_unique<LoopAnalysisManager>(); 
     ThePIC = std::make_unique<PassInstrumentationCallbacks>(); 
     TheSI = std::make_unique<StandardInstrumentations>(*TheContext, true);
     TheSI->registerCallbacks(*ThePIC, TheMAM.get());
 
     // add transform passes 
+    // promote allocas to registers
+    TheFPM->addPass(SROAPass(SROAOptions::ModifyCFG));
     // do simple "peephole" optimizations and bit-twiddling optimizations
     TheFPM->addPass(InstCombinePass());
     // Reassociate expressions
@@ -539,92 +4203,983 @@ void InitializeModuleAndManagers(void) {
     TheFPM->addPass(GVNPass());
     // Simplify the control flow graph (deleting unreachable blocks, etc)
     TheFPM->addPass(SimplifyCFGPass());
+    // turn recursive calls in tail position into a loop, ahead of the loop
+    // passes
+    TheFPM->addPass(TailCallElimPass());
 
-    // Register analysis passes used in these transform passes
-    PassBuilder PB; 
+    // loop passes: put loops into canonical form, hoist invariant code out
+    // of them and canonicalize their induction variables, then vectorize and
+    // unroll what is left and clean up after both.
+    //
+    // Array bounds checks go first. IRCE splits the iterations of a loop
+    // whose entry is guarded by its bound into ranges where the checks
+    // cannot fail, which run without them; it has to see the checks before
+    // IndVarSimplify rewrites them. IndVarSimplify turns the checks of a loop
+    // without side effects into one invariant test, which unswitching then
+    // takes out of the loop.
+    TheFPM->addPass(LoopSimplifyPass());
+    TheFPM->addPass(IRCEPass());
+    LoopPassManager LPM;
+    LPM.addPass(LICMPass());
+    LPM.addPass(IndVarSimplifyPass());
+    LPM.addPass(SimpleLoopUnswitchPass());
+    TheFPM->addPass(createFunctionToLoopPassAdaptor(std::move(LPM),
+                                                    /*UseMemorySSA=*/true));
+    // calls to the math functions vectorize to calls to their vector
+    // versions, where the target library info knows of any
+    TheFPM->addPass(InjectTLIMappings());
+    TheFPM->addPass(LoopVectorizePass());
+    TheFPM->addPass(LoopUnrollPass());
+    TheFPM->addPass(InstCombinePass());
+    TheFPM->addPass(SimplifyCFGPass());
+    if (BalanceChains)
+        TheFPM->addPass(BalanceChainsPass());
+
+    // Register analysis passes used in these transform passes, with the
+    // target machine supplying the target's costs
+    PassBuilder PB(TM.get());
+    TargetLibraryInfoImpl TLII = getTargetLibraryInfo(TM->getTargetTriple());
+    TheFAM->registerPass([&] { return TargetLibraryAnalysis(TLII); });
     PB.registerModuleAnalyses(*TheMAM); 
+    PB.registerCGSCCAnalyses(*TheCGAM);
     PB.registerFunctionAnalyses(*TheFAM);
+    PB.registerLoopAnalyses(*TheLAM);
     PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
 
 }
 
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
-        if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Read a function definition:");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
+// skipUnchangedDefinition - Called with CurTok on the first token of a
+// definition. If the tokens that follow are the same as those of a definition
+// compiled earlier, under the same name, consume them and return true: that
+// function is in the JIT already, so there is nothing to parse, generate or
+// add. Otherwise put back every token looked at and return false, for the
+// parser to start over.
+bool CompilerSession::skipUnchangedDefinition() {
+    SmallVector<TokenRecord, 32> Seen;
+    Seen.push_back(currentToken());
+    // the name comes after the 'def', past "precision(mode)" and 'memo' if
+    // they are there
+    while (CurTok != tok_def && Seen.size() < 6) {
+        getNextToken();
+        Seen.push_back(currentToken());
+    }
+    getNextToken();
+    Seen.push_back(currentToken());
+
+    auto It = CurTok == tok_identifier ? DefinitionTokens.find(IdentifierSym)
+                                       : DefinitionTokens.end();
+    if (It != DefinitionTokens.end()) {
+        ArrayRef<TokenRecord> Known = It->second;
+        while (Seen.size() <= Known.size() && Seen.back() == Known[Seen.size() - 1]) {
+            if (Seen.size() < Known.size()) {
+                getNextToken();
+                Seen.push_back(currentToken());
+                continue;
+            }
+            // Every token matched. The old definition ended where the parser
+            // found no operator to carry the expression on, so this one does
+            // too unless the next token is one, or is a '(' that would turn
+            // the last identifier into a call.
+            getNextToken();
+            if (GetTokPrecedence() <= 0 &&
+                !(Known.back().Tok == tok_identifier && CurTok == '('))
+                return true;
+            Seen.push_back(currentToken());
+            break;
+        }
+    }
+
+    // Seen ends with the current token, so replaying it all leaves the lexer
+    // where it is and CurTok back on the first token of the definition
+    Replay.erase(Replay.begin(), Replay.begin() + ReplayPos);
+    Replay.insert(Replay.begin(), Seen.begin(), Seen.end());
+    ReplayPos = 0;
+    getNextToken();
+    return false;
+}
+
+void CompilerSession::HandleDefinition() {
+    if (skipUnchangedDefinition())
+        return;
+
+    Recorded.clear();
+    RecordTokens = true;
+    ItemIsPure = true;
+    auto FnAST = ParseDefinition();
+    RecordTokens = false;
+    if (FnAST) {
+        SymbolID Name = FnAST->getName();
+        if (compileDefinition(std::move(FnAST)))
+            DefinitionTokens[Name] = std::move(Recorded);
+    } else {
+        // skip token for error recovery
+        getNextToken();
+    }
+}
+
+// compileDefinition - Simplify the definition just read, then either write it
+// out or generate it and hand it to the JIT. Returns true on success.
+bool CompilerSession::compileDefinition(std::unique_ptr<FunctionAST> FnAST) {
+    FnAST->simplify(AST);
+    SymbolID Name = FnAST->getName();
+    // an earlier definition may already be in the JIT, where a second one
+    // would only show up as a duplicate symbol at link time
+    if (DefinedFunctions.count(Name)) {
+        LogError("Function cannot be redefined");
+        return false;
+    }
+    // a cached result only stands in for a call that would give the same
+    // again; calls to itself are fine, they are cached too
+    if (FnAST->isMemo()) {
+        const PrototypeAST &P = FnAST->getProto();
+        for (unsigned I = 0, E = P.getArgs().size(); I != E; ++I)
+            if (P.isArrayArg(I)) {
+                LogError("A memoized function cannot take arrays");
+                return false;
+            }
+        if (!callsOnlyPure(FnAST->getBody(), Name)) {
+            LogError("Only a function without side effects can be memoized");
+            return false;
         }
+        ItemIsPure = true;
+    }
+    // what an extern before it said, which stands if the definition fails
+    bool WasPure = PureFunctions.count(Name);
+    unsigned WasInfo = FunctionInfos.lookup(Name);
+    Intrinsic::ID WasMath = MathExterns.lookup(Name);
+    // a definition of its own for a math function it declared first
+    if (MathExterns.erase(Name))
+        PureFunctions.erase(Name);
+    // what its body does, for the attributes of the calls to it; the cache
+    // of a memoized function is memory of its own
+    unsigned Info = inferFunctionInfo(FnAST->getBody(), Name);
+    if (Info & FI_ReadNone)
+        ItemIsPure = true;
+    if (FnAST->isMemo())
+        Info &= ~(FI_ReadNone | FI_ReadOnly);
+    FunctionInfos[Name] = Info;
+    if (Writer) {
+        Writer->addDefinition(*FnAST);
+        DefinedFunctions.insert(Name);
+        if (ItemIsPure)
+            PureFunctions.insert(Name);
+        return true;
+    }
+
+    auto *FnIR = FnAST->codegen(*this);
+    if (!FnIR) {
+        if (WasPure)
+            PureFunctions.insert(Name);
+        if (WasInfo)
+            FunctionInfos[Name] = WasInfo;
+        else
+            FunctionInfos.erase(Name);
+        if (WasMath)
+            MathExterns[Name] = WasMath;
+        return false;
+    }
+    DefinedFunctions.insert(Name);
+    if (ItemIsPure)
+        PureFunctions.insert(Name);
+    if (CompileOnly)
+        return true;
+    if (InlineDefSize) {
+        retainIR(FnIR);
+        retainIR(TheModule->getFunction((Symbols.getName(Name) + ".i").str()));
+    }
+
+    fprintf(stderr, "Read a function definition:");
+    FnIR->print(errs()); 
+    fprintf(stderr, "\n");
+
+    // the definition goes to the JIT with its chunk, which is added before
+    // any later item can run
+    collectCallees(FnAST->getBody(), Callees[Name]);
+    PendingDefs.push_back(Name);
+    if (PendingDefs.size() >= DefBatch)
+        flushDefinitions();
+    return true;
+}
+
+
+void CompilerSession::HandleExtern() {
+    bool Pure;
+    if (auto ProtoAST = ParseExtern(Pure)) {
+        compileExtern(std::move(ProtoAST), Pure);
     } else {
         // skip token for error recovery
         getNextToken();
     }
 }
 
+// the C math functions that have an intrinsic, by name and number of arguments
+static const struct {
+    const char *Name;
+    unsigned NumArgs;
+    Intrinsic::ID ID;
+} MathFunctions[] = {
+    {"sqrt", 1, Intrinsic::sqrt},   {"sin", 1, Intrinsic::sin},
+    {"cos", 1, Intrinsic::cos},     {"exp", 1, Intrinsic::exp},
+    {"exp2", 1, Intrinsic::exp2},   {"log", 1, Intrinsic::log},
+    {"log2", 1, Intrinsic::log2},   {"log10", 1, Intrinsic::log10},
+    {"fabs", 1, Intrinsic::fabs},   {"floor", 1, Intrinsic::floor},
+    {"ceil", 1, Intrinsic::ceil},   {"trunc", 1, Intrinsic::trunc},
+    {"round", 1, Intrinsic::round}, {"pow", 2, Intrinsic::pow},
+    {"fmin", 2, Intrinsic::minnum}, {"fmax", 2, Intrinsic::maxnum},
+    {"copysign", 2, Intrinsic::copysign},
+};
+
+// getMathIntrinsic - The intrinsic for the C math function P declares, if it
+// is one
+static Intrinsic::ID getMathIntrinsic(const PrototypeAST &P, const SymbolTable &Symbols) {
+    for (unsigned I = 0, E = P.getArgs().size(); I != E; ++I)
+        if (P.isArrayArg(I))
+            return Intrinsic::not_intrinsic;
+    for (const auto &MF : MathFunctions)
+        if (Symbols.getName(P.getName()) == MF.Name && P.getArgs().size() == MF.NumArgs)
+            return MF.ID;
+    return Intrinsic::not_intrinsic;
+}
 
-static void HandleExtern() {
-    if (auto ProtoAST = ParseExtern()) {
-        if (auto *FnIR = ProtoAST->codegen()) {
+// compileExtern - Declare ProtoAST, a function of the host or of a later
+// definition. An extern declared pure promises it has no side effects and
+// looks at nothing but its arguments, the elements of any arrays included:
+// calls to one without arrays can be shared, and with arrays it only reads.
+void CompilerSession::compileExtern(std::unique_ptr<PrototypeAST> ProtoAST, bool Pure) {
+    SymbolID Name = ProtoAST->getName();
+    bool TakesArrays = false;
+    for (unsigned I = 0, E = ProtoAST->getArgs().size(); I != E; ++I)
+        TakesArrays |= ProtoAST->isArrayArg(I);
+    // an extern replaces what one before it said, but of a function that is
+    // defined already, the definition knows better
+    if (!DefinedFunctions.count(Name)) {
+        MathExterns.erase(Name);
+        PureFunctions.erase(Name);
+        FunctionInfos.erase(Name);
+        // the math functions have no side effects, so their calls can be
+        // shared as soon as they are parsed
+        if (Intrinsic::ID ID = getMathIntrinsic(*ProtoAST, Symbols)) {
+            MathExterns[Name] = ID;
+            PureFunctions.insert(Name);
+            FunctionInfos[Name] = FI_ReadNone | FI_ReadOnly | FI_WillReturn | FI_NoFree;
+        } else if (Pure && TakesArrays) {
+            FunctionInfos[Name] = FI_ReadOnly | FI_NoFree;
+        } else if (Pure) {
+            PureFunctions.insert(Name);
+            FunctionInfos[Name] = FI_ReadNone | FI_ReadOnly | FI_NoFree;
+        }
+    }
+    if (Writer) {
+        Writer->addExtern(*ProtoAST, Pure);
+        return;
+    }
+    if (auto *FnIR = ProtoAST->codegen(*this)) {
+        if (!CompileOnly) {
             fprintf(stderr, "Read extern: ");
             FnIR->print(errs()); 
             fprintf(stderr, "\n");
         }
-    } else {
-        // skip token for error recovery
-        getNextToken();
+        FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
     }
 }
 
-static void HandleTopLevelExpression() {
+void CompilerSession::HandleTopLevelExpression() {
     // Evaluate a top-level expression into an anon function
+    ItemIsPure = true;
     if (auto FnAST = ParseTopLevelExpr()) {
-       if (FnAST->codegen()) {
-           // Create a ResourceTracker to track JIT's memory allocated to our
-           // anonymous expression - that way we can free it after executing 
-           auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-
-           auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-           ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-           InitializeModuleAndManagers();
-
-           // Search the JIT for the __anon_expr symbol 
-           auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-
-           // get the symbols address and cast it to the right type (takes no
-           // arguments, returns a doube) so we can call it as a native function
-           double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
-           fprintf(stderr, "Evaluated to %f\n", FP());
-
-           // Delete the anon expression module from the JIT
-           ExitOnErr(RT->remove());
-       }
+        compileTopLevelExpr(std::move(FnAST));
     } else {
         // skip token for error recovery
         getNextToken();
     }
 }
 
+void CompilerSession::compileTopLevelExpr(std::unique_ptr<FunctionAST> FnAST) {
+    FnAST->simplify(AST);
+    if (Writer) {
+        Writer->addTopLevelExpr(FnAST->getBody());
+        return;
+    }
+
+    // an expression that folds to a constant needs no code at all
+    if (auto *N = dyn_cast<NumberExprAST>(FnAST->getBody())) {
+        flushBatch();
+        if (CompileOnly)
+            PendingExprs.push_back({"", true, N->getVal()});
+        else
+            fprintf(stderr, "Evaluated to %f\n", N->getVal());
+        return;
+    }
+
+    // everything this calls has to be in the JIT, and stay there
+    if (!CompileOnly) {
+        touchCallees(FnAST->getBody());
+        flushDefinitions();
+    }
+
+    // a script's expressions need not be answered one by one
+    if (!Interactive && !CompileOnly && canBatch(FnAST->getBody())) {
+        addToBatch(FnAST->getBody());
+        return;
+    }
+    flushBatch();
+
+    if (auto *FnIR = FnAST->codegen(*this)) {
+        if (CompileOnly) {
+            PendingExprs.push_back({FnIR->getName().str(), false, 0.0});
+            return;
+        }
+
+        // Create a ResourceTracker to track JIT's memory allocated to our
+        // anonymous expression - that way we can free it after executing 
+        auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+
+        inlineEarlierDefinitions();
+        auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+        ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
+        InitializeModuleAndManagers();
+
+        // Search the JIT for the __anon_expr symbol 
+        auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+
+        // get the symbols address and cast it to the right type (takes no
+        // arguments, returns a doube) so we can call it as a native function
+        double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
+        double Result = FP();
+        if (!reportBoundsError())
+            fprintf(stderr, "Evaluated to %f\n", Result);
+
+        // Delete the anon expression module from the JIT
+        ExitOnErr(RT->remove());
+    }
+}
+
+// touchCallees - Mark the chunks of the definitions E calls as used by the
+// current item, which keeps them from being evicted under it
+void CompilerSession::touchCallees(ExprAST *E) {
+    if (!MaxLiveDefs)
+        return;
+    std::vector<SymbolID> Called;
+    collectCallees(E, Called);
+    for (SymbolID Callee : Called) {
+        auto It = ChunkOf.find(Callee);
+        if (It != ChunkOf.end())
+            It->second->LastUse = ItemCount;
+    }
+}
+
+// retainIR - Keep a copy of F, just generated, for inlineEarlierDefinitions,
+// if it is small enough and stands on its own: a memoized function's cache
+// and a parfor loop's body belong to its module
+void CompilerSession::retainIR(Function *F) {
+    if (!F || F->getInstructionCount() > InlineDefSize)
+        return;
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> M =
+        CloneModule(*TheModule, VMap, [F](const GlobalValue *GV) { return GV == F; });
+    // the rest of the module is left as declarations, of which it only
+    // needs those it calls
+    for (Function &G : make_early_inc_range(*M))
+        if (G.isDeclaration() && G.use_empty())
+            G.eraseFromParent();
+    for (GlobalVariable &G : make_early_inc_range(M->globals()))
+        if (G.isDeclaration() && G.use_empty())
+            G.eraseFromParent();
+    for (GlobalValue &G : M->global_values())
+        if (G.isDeclaration() && TheModule->getNamedValue(G.getName())->hasLocalLinkage())
+            return;
+    SmallVector<char, 0> &Bitcode = RetainedIR[F->getName()];
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(*M, OS);
+}
+
+// inlineEarlierDefinitions - Inline the small definitions of earlier items
+// into TheModule before it goes to the JIT, where calls between modules
+// would otherwise always be calls. Each one TheModule calls is brought in as
+// an available_externally copy, which the inliner can take from but which is
+// never compiled, and with it the ones that calls.
+void CompilerSession::inlineEarlierDefinitions() {
+    SmallPtrSet<Function *, 8> Imported;
+    for (bool Changed = true; Changed;) {
+        Changed = false;
+        SmallVector<std::string, 8> Wanted;
+        for (Function &F : *TheModule)
+            if (F.isDeclaration() && RetainedIR.count(F.getName()))
+                Wanted.push_back(F.getName().str());
+        for (const std::string &Name : Wanted) {
+            const SmallVector<char, 0> &Bitcode = RetainedIR.find(Name)->second;
+            auto M = parseBitcodeFile(
+                MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), Name), *TheContext);
+            if (!M) {
+                consumeError(M.takeError());
+                continue;
+            }
+            for (Function &F : **M)
+                if (!F.isDeclaration())
+                    F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+            if (Linker::linkModules(*TheModule, std::move(*M)))
+                continue;
+            if (Function *F = TheModule->getFunction(Name); F && !F->isDeclaration()) {
+                Imported.insert(F);
+                Changed = true;
+            }
+        }
+    }
+    if (Imported.empty())
+        return;
+
+    // what the calls are inlined into has to be optimized again after, if
+    // it has not been inlined itself and gone
+    SmallSetVector<Function *, 8> Callers;
+    for (Function *G : Imported)
+        for (User *U : G->users())
+            if (auto *I = dyn_cast<Instruction>(U))
+                if (!Imported.count(I->getFunction()))
+                    Callers.insert(I->getFunction());
+    SmallVector<WeakVH, 8> Handles(Callers.begin(), Callers.end());
+    ModulePassManager MPM;
+    MPM.addPass(ModuleInlinerWrapperPass());
+    MPM.addPass(EliminateAvailableExternallyPass());
+    MPM.run(*TheModule, *TheMAM);
+    for (WeakVH &H : Handles)
+        if (auto *F = cast_or_null<Function>(H))
+            TheFPM->run(*F, *TheFAM);
+}
+
+// flushDefinitions - Add the definitions generated into TheModule so far to
+// the JIT, as a new chunk
+void CompilerSession::flushDefinitions() {
+    if (PendingDefs.empty())
+        return;
+    inlineEarlierDefinitions();
+    auto C = Chunks.insert(Chunks.end(), DefinitionChunk{
+        TheJIT->getMainJITDylib().createResourceTracker(), std::move(PendingDefs),
+        ItemCount});
+    PendingDefs.clear();
+    ExitOnErr(TheJIT->addModule(
+        ThreadSafeModule(std::move(TheModule), std::move(TheContext)), C->RT));
+    InitializeModuleAndManagers();
+
+    for (SymbolID Def : C->Defs)
+        ChunkOf[Def] = C;
+    // calls into other chunks pin those
+    for (SymbolID Def : C->Defs)
+        for (SymbolID Callee : Callees[Def]) {
+            auto It = ChunkOf.find(Callee);
+            if (It != ChunkOf.end() && It->second != C)
+                ++ExternalCallers[Callee];
+        }
+    evictDefinitions();
+}
+
+// evictDefinitions - While the JIT holds more than -max-live-defs
+// definitions, drop the least recently used chunk that no other chunk calls
+// into and the current item does not use. Its functions are forgotten
+// altogether: calling one is an error again, and the name may be defined anew.
+void CompilerSession::evictDefinitions() {
+    if (!MaxLiveDefs)
+        return;
+    while (ChunkOf.size() > MaxLiveDefs) {
+        auto Victim = Chunks.end();
+        for (auto It = Chunks.begin(); It != Chunks.end(); ++It) {
+            if (It->LastUse == ItemCount ||
+                any_of(It->Defs, [&](SymbolID D) { return ExternalCallers.lookup(D); }))
+                continue;
+            if (Victim == Chunks.end() || It->LastUse < Victim->LastUse)
+                Victim = It;
+        }
+        if (Victim == Chunks.end())
+            return;
+        evictChunk(Victim);
+    }
+}
+
+void CompilerSession::evictChunk(std::list<DefinitionChunk>::iterator C) {
+    ExitOnErr(C->RT->remove());
+    for (SymbolID Def : C->Defs)
+        for (SymbolID Callee : Callees[Def]) {
+            auto It = ChunkOf.find(Callee);
+            if (It != ChunkOf.end() && It->second != C)
+                --ExternalCallers[Callee];
+        }
+    for (SymbolID Def : C->Defs) {
+        ChunkOf.erase(Def);
+        Callees.erase(Def);
+        ExternalCallers.erase(Def);
+        DefinedFunctions.erase(Def);
+        PureFunctions.erase(Def);
+        FunctionInfos.erase(Def);
+        FunctionProtos.erase(Def);
+        DefinitionTokens.erase(Def);
+        IntSpecializations.erase(Def);
+        RetainedIR.erase(Symbols.getName(Def));
+        RetainedIR.erase((Symbols.getName(Def) + ".i").str());
+    }
+    Chunks.erase(C);
+}
+
+// reportRSS - Print the resident set size, from /proc where there is one and
+// otherwise the peak getrusage knows of
+static void reportRSS(uint64_t Items) {
+    const char *What = "rss";
+    uint64_t KiB = 0;
+    if (FILE *F = fopen("/proc/self/statm", "r")) {
+        unsigned long long Size, Resident;
+        if (fscanf(F, "%llu %llu", &Size, &Resident) == 2)
+            KiB = Resident * sys::Process::getPageSizeEstimate() / 1024;
+        fclose(F);
+    }
+#if LLVM_ON_UNIX
+    if (!KiB) {
+        struct rusage RU;
+        if (getrusage(RUSAGE_SELF, &RU) == 0) {
+            KiB = RU.ru_maxrss;
+#if defined(__APPLE__)
+            KiB /= 1024; // bytes there
+#endif
+            What = "peak rss";
+        }
+    }
+#endif
+    fprintf(stderr, "%s: %llu KiB after %llu items\n", What,
+            (unsigned long long)KiB, (unsigned long long)Items);
+}
+
+// finishItem - Called once each item has been handled (or given up on)
+void CompilerSession::finishItem() {
+    // none of the item's AST nodes are referenced any more, unless the batch
+    // still uses them
+    if (!BatchFn)
+        AST.Reset();
+    ++ItemCount;
+    if (RSSInterval && ItemCount % RSSInterval == 0)
+        reportRSS(ItemCount);
+}
+
+// canBatch - True if E can join the batch: it calls nothing but pure
+// functions, with the right number of arguments, and has no variables, so
+// its code generation cannot fail and running it early changes nothing.
+bool CompilerSession::canBatch(ExprAST *E) {
+    SmallVector<ExprAST *, 32> Work = {E};
+    SmallPtrSet<ExprAST *, 32> Visited;
+    while (!Work.empty()) {
+        ExprAST *N = Work.pop_back_val();
+        if (!Visited.insert(N).second)
+            continue;
+        switch (N->getKind()) {
+            case ExprAST::EK_Number:
+                break;
+            case ExprAST::EK_Variable:
+                return false;
+            case ExprAST::EK_Binary:
+                Work.push_back(cast<BinaryExprAST>(N)->getLHS());
+                Work.push_back(cast<BinaryExprAST>(N)->getRHS());
+                break;
+            case ExprAST::EK_Call: {
+                auto *C = cast<CallExprAST>(N);
+                auto It = FunctionProtos.find(C->getCallee());
+                if (!PureFunctions.count(C->getCallee()) || It == FunctionProtos.end())
+                    return false;
+                const PrototypeAST &P = *It->second;
+                if (P.getArgs().size() != C->getArgs().size())
+                    return false;
+                // there are no arrays to pass in a batch, and a call that
+                // passes something else fails
+                for (unsigned I = 0, E = P.getArgs().size(); I != E; ++I)
+                    if (P.isArrayArg(I))
+                        return false;
+                append_range(Work, C->getArgs());
+                break;
+            }
+            case ExprAST::EK_If:
+                N->forEachOperand([&](ExprAST *Op) { Work.push_back(Op); });
+                break;
+            case ExprAST::EK_For:
+            case ExprAST::EK_ParFor:
+            case ExprAST::EK_Var:
+                // refers to variables of its own, and is hardly worth batching
+                return false;
+            case ExprAST::EK_Index:
+                return false;
+        }
+    }
+    return true;
+}
+
+// addToBatch - Generate E into the batch function, opening one if need be.
+// The batch is flushed once it is this big, to bound the latency of answers
+// and the memory held by the AST nodes it keeps alive.
+static const unsigned MaxBatchSize = 1024;
+
+void CompilerSession::addToBatch(ExprAST *E) {
+    if (!BatchFn) {
+        // void __anon_batch(double *Out)
+        FunctionType *FT = FunctionType::get(Type::getVoidTy(*TheContext),
+                                             {PointerType::getUnqual(*TheContext)},
+                                             false);
+        BatchFn = Function::Create(FT, Function::ExternalLinkage, "__anon_batch",
+                                   TheModule.get());
+        BatchEnd = BasicBlock::Create(*TheContext, "entry", BatchFn);
+        BatchEndSize = 0;
+        BatchBlocks = 1;
+        Builder->SetInsertPoint(BatchEnd);
+        NamedValues.clear();
+        resetValueScopes();
+    }
+
+    // an error runs the batch up to this expression, and leaves it at that
+    Value *V = E->codegen(*this);
+    if (V)
+        V = convertTo(V, Builder->getDoubleTy());
+    if (!V) {
+        flushBatch();
+        return;
+    }
+    Value *Slot = Builder->CreateConstGEP1_32(Type::getDoubleTy(*TheContext),
+                                              BatchFn->getArg(0), BatchSize++);
+    Builder->CreateStore(V, Slot);
+    BatchEnd = Builder->GetInsertBlock();
+    BatchEndSize = BatchEnd->size();
+    BatchBlocks = BatchFn->size();
+    if (BatchSize == MaxBatchSize)
+        flushBatch();
+}
+
+// flushBatch - Run the batch collected so far, if any, and print its results
+// in order
+void CompilerSession::flushBatch() {
+    if (!BatchFn)
+        return;
+    // an expression that failed part way through, and flushes the batch to
+    // report it, leaves code behind; that is cut off
+    if (Builder->GetInsertBlock() != BatchEnd || BatchEnd->size() != BatchEndSize) {
+        SmallVector<BasicBlock *, 8> Added;
+        for (BasicBlock &BB : drop_begin(*BatchFn, BatchBlocks))
+            Added.push_back(&BB);
+        for (BasicBlock *BB : Added)
+            BB->dropAllReferences();
+        while (BatchEnd->size() != BatchEndSize)
+            BatchEnd->back().eraseFromParent();
+        for (BasicBlock *BB : Added)
+            BB->eraseFromParent();
+        Builder->SetInsertPoint(BatchEnd);
+    }
+    Builder->CreateRetVoid();
+    verifyFunction(*BatchFn);
+    TheFPM->run(*BatchFn, *TheFAM);
+    inlineEarlierDefinitions();
+
+    auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+    auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+    ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
+    InitializeModuleAndManagers();
+
+    auto BatchSymbol = ExitOnErr(TheJIT->lookup("__anon_batch"));
+    void (*FP)(double *) = BatchSymbol.getAddress().toPtr<void (*)(double *)>();
+    std::vector<double> Results(BatchSize);
+    FP(Results.data());
+    // which of the expressions ran out of bounds is not known, so none of
+    // the results can be trusted then
+    if (!reportBoundsError())
+        for (double Result : Results)
+            fprintf(stderr, "Evaluated to %f\n", Result);
+
+    ExitOnErr(RT->remove());
+    BatchFn = nullptr;
+    BatchSize = 0;
+}
+
 // top ::= definition | external | expression | ';'
-static void MainLoop() {
+void CompilerSession::MainLoop() {
     while (true) {
-        fprintf(stderr, "ready> "); 
+        if (Interactive)
+            fprintf(stderr, "ready> ");
         switch (CurTok) {
             case tok_eof:
+                flushBatch();
                 return;
             case ';':   //ignore top-level semicolons
                 getNextToken();
-                break;
+                continue;
             case tok_def:
+            case tok_memo:
+            case tok_precision:
+                flushBatch();
                 HandleDefinition(); 
                 break;
             case tok_extern:
+                flushBatch();
                 HandleExtern(); 
                 break;
             default:
                 HandleTopLevelExpression(); 
                 break;
         }
+        finishItem();
+    }
+}
+
+void CompilerSession::run(FILE *Src) {
+    In = Src;
+    Buf.reset();
+    CurPtr = BufEnd = nullptr;
+    Interactive = true;
+
+    // prime the first token
+    fprintf(stderr, "ready> ");
+    getNextToken();
+
+    MainLoop();
+}
+
+void CompilerSession::run(std::unique_ptr<MemoryBuffer> Src) {
+    if (Src->getBuffer().starts_with(StringRef(kbc::Magic, sizeof(kbc::Magic)))) {
+        runKBC(*Src);
+        return;
+    }
+
+    In = nullptr;
+    Buf = std::move(Src);
+    CurPtr = Buf->getBufferStart();
+    BufEnd = Buf->getBufferEnd();
+    Interactive = false;
+
+    getNextToken();
+    MainLoop();
+}
+
+void CompilerSession::emitKBC(std::unique_ptr<MemoryBuffer> Src, raw_ostream &OS) {
+    KBCWriter W(Symbols);
+    Writer = &W;
+    run(std::move(Src));
+    Writer = nullptr;
+    W.write(OS);
+}
+
+// runKBC - Compile and run the items of a precompiled script, mapped in as
+// Src. Everything is checked against the bounds of its table as it is used,
+// so a damaged file is reported rather than followed off the end.
+void CompilerSession::runKBC(MemoryBufferRef Src) {
+    StringRef Data = Src.getBuffer();
+    if (Data.size() < sizeof(kbc::Header)) {
+        LogError("truncated .kbc file");
+        return;
+    }
+    auto *H = reinterpret_cast<const kbc::Header *>(Data.data());
+    if (H->Version != kbc::Version) {
+        LogError("unsupported .kbc version");
+        return;
+    }
+
+    // lay the tables out over the file
+    uint64_t Size = sizeof(kbc::Header);
+    auto Table = [&](uint32_t N, size_t ElemSize) {
+        const char *T = Data.data() + Size;
+        Size += uint64_t(N) * ElemSize;
+        return T;
+    };
+    auto *Strings = reinterpret_cast<const kbc::StringEntry *>(
+        Table(H->NumStrings, sizeof(kbc::StringEntry)));
+    auto *Nodes = reinterpret_cast<const kbc::Node *>(
+        Table(H->NumNodes, sizeof(kbc::Node)));
+    auto *Operands = reinterpret_cast<const support::ulittle32_t *>(
+        Table(H->NumOperands, sizeof(support::ulittle32_t)));
+    auto *Protos = reinterpret_cast<const kbc::Prototype *>(
+        Table(H->NumPrototypes, sizeof(kbc::Prototype)));
+    auto *Items = reinterpret_cast<const kbc::Item *>(
+        Table(H->NumItems, sizeof(kbc::Item)));
+    const char *StringData = Table(H->StringDataSize, 1);
+    if (Size > Data.size()) {
+        LogError("truncated .kbc file");
+        return;
+    }
+
+    // the file's symbols, interned into this session
+    std::vector<SymbolID> Syms;
+    Syms.reserve(H->NumStrings);
+    for (const kbc::StringEntry &S : ArrayRef(Strings, H->NumStrings)) {
+        if (uint64_t(S.Offset) + S.Size > H->StringDataSize) {
+            LogError("malformed .kbc file");
+            return;
+        }
+        Syms.push_back(Symbols.intern(StringRef(StringData + S.Offset, S.Size)));
+    }
+
+    auto LoadPrototype = [&](uint32_t I) -> std::unique_ptr<PrototypeAST> {
+        if (I >= H->NumPrototypes)
+            return nullptr;
+        const kbc::Prototype &KP = Protos[I];
+        if (KP.Name >= Syms.size() ||
+            uint64_t(KP.FirstParam) + KP.NumParams > H->NumOperands)
+            return nullptr;
+        std::vector<SymbolID> Args;
+        std::vector<bool> IsArray;
+        for (uint32_t Param : ArrayRef(Operands + KP.FirstParam, KP.NumParams)) {
+            IsArray.push_back(Param & kbc::ArrayParam);
+            Param &= ~kbc::ArrayParam;
+            if (Param >= Syms.size())
+                return nullptr;
+            Args.push_back(Syms[Param]);
+        }
+        return std::make_unique<PrototypeAST>(Syms[KP.Name], std::move(Args),
+                                              std::move(IsArray));
+    };
+
+    // Rebuild an item's nodes through the ASTContext, so they are hash-consed
+    // just as if they had been parsed. A call is only shared if its callee is
+    // known to be pure here too.
+    SmallVector<ExprAST *, 32> ItemNodes;
+    auto LoadBody = [&](const kbc::Item &I) -> ExprAST * {
+        if (I.NumNodes == 0 || uint64_t(I.FirstNode) + I.NumNodes > H->NumNodes)
+            return nullptr;
+        ItemNodes.clear();
+        for (const kbc::Node &N : ArrayRef(Nodes + I.FirstNode, I.NumNodes)) {
+            uint32_t Done = ItemNodes.size();
+            ExprAST *E = nullptr;
+            switch (N.Kind) {
+                case ExprAST::EK_Number:
+                    E = AST.getNumber(bit_cast<double>(uint64_t(N.B)));
+                    break;
+                case ExprAST::EK_Variable:
+                    if (N.A < Syms.size())
+                        E = AST.getVariable(Syms[N.A]);
+                    break;
+                case ExprAST::EK_Binary:
+                    if (N.A < Done && N.B < Done)
+                        E = AST.getBinary(N.Op, ItemNodes[N.A], ItemNodes[N.B]);
+                    break;
+                case ExprAST::EK_Call: {
+                    uint64_t First = N.B & 0xFFFFFFFF, NumArgs = N.B >> 32;
+                    if (N.A >= Syms.size() || First + NumArgs > H->NumOperands)
+                        break;
+                    SmallVector<ExprAST *, 8> Args;
+                    for (uint32_t Arg : ArrayRef(Operands + First, NumArgs)) {
+                        if (Arg >= Done)
+                            return nullptr;
+                        Args.push_back(ItemNodes[Arg]);
+                    }
+                    bool Pure = N.Shared && (isBuiltin(Syms[N.A]) ||
+                                             PureFunctions.count(Syms[N.A]));
+                    ItemIsPure &= Pure;
+                    E = AST.getCall(Syms[N.A], Args, Pure);
+                    break;
+                }
+                case ExprAST::EK_If: {
+                    uint64_t Then = N.B & 0xFFFFFFFF, Else = N.B >> 32;
+                    if (N.A < Done && Then < Done && Else < Done)
+                        E = AST.getIf(ItemNodes[N.A], ItemNodes[Then], ItemNodes[Else]);
+                    break;
+                }
+                case ExprAST::EK_For: {
+                    uint64_t First = N.B & 0xFFFFFFFF, NumParts = N.B >> 32;
+                    if (N.A >= Syms.size() || (NumParts != 3 && NumParts != 4) ||
+                        First + NumParts > H->NumOperands)
+                        break;
+                    ExprAST *Parts[4];
+                    for (unsigned P = 0; P != NumParts; ++P) {
+                        if (Operands[First + P] >= Done)
+                            return nullptr;
+                        Parts[P] = ItemNodes[Operands[First + P]];
+                    }
+                    ExprAST *Step = NumParts == 4 ? Parts[2] : nullptr;
+                    E = AST.getFor(Syms[N.A], Parts[0], Parts[1], Step, Parts[NumParts - 1]);
+                    break;
+                }
+                case ExprAST::EK_ParFor: {
+                    uint64_t First = N.B & 0xFFFFFFFF, NumParts = N.B >> 32;
+                    if (N.A >= Syms.size() || NumParts != 3 ||
+                        (N.Op != 0 && N.Op != '+' && N.Op != '*') ||
+                        First + NumParts > H->NumOperands)
+                        break;
+                    ExprAST *Parts[3];
+                    for (unsigned P = 0; P != 3; ++P) {
+                        if (Operands[First + P] >= Done)
+                            return nullptr;
+                        Parts[P] = ItemNodes[Operands[First + P]];
+                    }
+                    E = AST.getParFor(Syms[N.A], N.Op, Parts[0], Parts[1], Parts[2]);
+                    break;
+                }
+                case ExprAST::EK_Var: {
+                    uint64_t First = N.B & 0xFFFFFFFF, NumParts = N.B >> 32;
+                    if (N.A >= Done || NumParts == 0 || NumParts % 2 != 0 ||
+                        First + NumParts > H->NumOperands)
+                        break;
+                    SmallVector<VarBinding, 4> Bindings;
+                    for (uint64_t P = First; P != First + NumParts; P += 2) {
+                        uint32_t Name = Operands[P], Init = Operands[P + 1];
+                        if (Name >= Syms.size() || (Init != kbc::NoInit && Init >= Done))
+                            return nullptr;
+                        Bindings.push_back({Syms[Name],
+                                            Init == kbc::NoInit ? nullptr : ItemNodes[Init]});
+                    }
+                    E = AST.getVar(Bindings, ItemNodes[N.A]);
+                    break;
+                }
+                case ExprAST::EK_Index:
+                    if (N.A < Syms.size() && N.B < Done) {
+                        ItemIsPure = false;
+                        E = AST.getIndex(Syms[N.A], ItemNodes[N.B]);
+                    }
+                    break;
+            }
+            if (!E)
+                return nullptr;
+            ItemNodes.push_back(E);
+        }
+        return ItemNodes.back();
+    };
+
+    for (const kbc::Item &I : ArrayRef(Items, H->NumItems)) {
+        // as in MainLoop, only top-level expressions go into a batch
+        if (I.Kind != kbc::IK_Expression)
+            flushBatch();
+        ItemIsPure = true;
+        bool OK = false;
+        switch (I.Kind) {
+            case kbc::IK_Definition:
+            case kbc::IK_MemoDefinition:
+                if (auto Proto = LoadPrototype(I.Proto))
+                    if (ExprAST *Body = LoadBody(I)) {
+                        compileDefinition(std::make_unique<FunctionAST>(
+                            std::move(Proto), Body, I.Kind == kbc::IK_MemoDefinition,
+                            (FPMode)std::min<uint32_t>(I.Precision, FP_Fast)));
+                        OK = true;
+                    }
+                break;
+            case kbc::IK_Extern:
+            case kbc::IK_PureExtern:
+                if (auto Proto = LoadPrototype(I.Proto)) {
+                    compileExtern(std::move(Proto), I.Kind == kbc::IK_PureExtern);
+                    OK = true;
+                }
+                break;
+            case kbc::IK_Expression:
+                if (ExprAST *Body = LoadBody(I)) {
+                    compileTopLevelExpr(makeTopLevelFunction(Body));
+                    OK = true;
+                }
+                break;
+        }
+        if (!OK) {
+            LogError("malformed .kbc file");
+            break;
+        }
+        finishItem();
     }
+    flushBatch();
+    AST.Reset();
+}
+
+void CompilerSession::compile(std::unique_ptr<MemoryBuffer> Src, unsigned ID) {
+    CompileOnly = true;
+    UnitID = ID;
+    UnitName = Src->getBufferIdentifier().str();
+    run(std::move(Src));
+}
+
+ThreadSafeModule CompilerSession::takeModule() {
+    return ThreadSafeModule(std::move(TheModule), std::move(TheContext));
 }
 
 
@@ -636,26 +5191,312 @@ static void MainLoop() {
 
 // main driver
 
-int main() {
+static cl::list<std::string> InputFilenames(cl::Positional,
+                                            cl::desc("[<script>...]"));
+static cl::opt<unsigned> Jobs("j",
+                              cl::desc("Number of scripts to compile at once "
+                                       "(default: one per core)"),
+                              cl::init(0));
+
+static cl::opt<std::string> EmitKBC("emit-kbc",
+                                    cl::desc("Precompile the script into a "
+                                             ".kbc file instead of running it"),
+                                    cl::value_desc("filename"));
+static cl::opt<bool> WholeScript("whole-script",
+                                 cl::desc("Compile the scripts into one module, and "
+                                          "optimize it as a whole before any of "
+                                          "it runs"));
+static cl::list<std::string> ArrayFiles("array",
+                                        cl::desc("Read the numbers in FILE into an "
+                                                 "array the scripts know as NAME"),
+                                        cl::value_desc("NAME=FILE"));
+
+static std::unique_ptr<MemoryBuffer> openScript(const std::string &Filename) {
+    // mapped rather than read, so the lexer can work on it in place
+    auto BufOrErr = MemoryBuffer::getFile(Filename, /*IsText=*/false,
+                                          /*RequiresNullTerminator=*/false);
+    if (!BufOrErr) {
+        fprintf(stderr, "Error: could not open %s: %s\n", Filename.c_str(),
+                BufOrErr.getError().message().c_str());
+        return nullptr;
+    }
+    return std::move(*BufOrErr);
+}
+
+// ArrayFile - The numbers of a -array NAME=FILE, which every session the
+// driver creates is handed as the array NAME
+struct ArrayFile {
+    std::string Name;
+    std::vector<double> Data;
+};
+
+// loadHostArray - Read the numbers of a -array NAME=FILE, separated by
+// whitespace or commas, into Array
+static bool loadHostArray(StringRef Spec, ArrayFile &Array) {
+    auto [Name, Filename] = Spec.split('=');
+    if (Name.empty() || Filename.empty()) {
+        fprintf(stderr, "Error: -array takes NAME=FILE\n");
+        return false;
+    }
+    auto Buf = openScript(Filename.str());
+    if (!Buf)
+        return false;
+    StringRef Text = Buf->getBuffer();
+    while (!(Text = Text.ltrim(" \t\r\n,")).empty()) {
+        double Val;
+        auto [End, EC] = std::from_chars(Text.begin(), Text.end(), Val);
+        if (EC != std::errc()) {
+            fprintf(stderr, "Error: %s: expected a number\n", Filename.str().c_str());
+            return false;
+        }
+        Array.Data.push_back(Val);
+        Text = Text.drop_front(End - Text.begin());
+    }
+    Array.Name = Name.str();
+    return true;
+}
+
+// addHostArrays - Hand the arrays of the -array files to the session S
+static void addHostArrays(CompilerSession &S, MutableArrayRef<ArrayFile> Arrays) {
+    for (ArrayFile &A : Arrays)
+        S.addHostArray(A.Name, A.Data.data(), A.Data.size());
+}
+
+// checkUnits - Cross-check the units of a program before linking them: each
+// function may only be defined once, and an extern in one unit has to agree
+// with the definition in another on the number of arguments, and on which of
+// them are arrays.
+static bool checkUnits(ArrayRef<std::unique_ptr<CompilerSession>> Units) {
+    struct Definition {
+        const CompilerSession *Unit;
+        const PrototypeAST *Proto;
+    };
+    StringMap<Definition> Defs;
+    bool OK = true;
+
+    // the sets are unordered, and each unit is looked at in the order its
+    // symbols were first seen, for the errors to come out the same each run
+    for (auto &U : Units) {
+        SmallVector<SymbolID, 32> Defined(U->DefinedFunctions.begin(),
+                                          U->DefinedFunctions.end());
+        llvm::sort(Defined);
+        for (SymbolID Name : Defined) {
+            StringRef FnName = U->Symbols.getName(Name);
+            auto Res = Defs.try_emplace(FnName,
+                                        Definition{U.get(), U->FunctionProtos[Name].get()});
+            if (!Res.second) {
+                fprintf(stderr, "%s: Error: '%s' is already defined in %s\n",
+                        U->getUnitName().str().c_str(), FnName.str().c_str(),
+                        Res.first->second.Unit->getUnitName().str().c_str());
+                OK = false;
+            }
+        }
+    }
+
+    for (auto &U : Units) {
+        SmallVector<SymbolID, 32> Declared;
+        for (auto &KV : U->FunctionProtos)
+            if (!U->DefinedFunctions.count(KV.first))
+                Declared.push_back(KV.first);
+        llvm::sort(Declared);
+        for (SymbolID Name : Declared) {
+            const PrototypeAST &Proto = *U->FunctionProtos.find(Name)->second;
+            StringRef FnName = U->Symbols.getName(Name);
+            auto It = Defs.find(FnName);
+            if (It == Defs.end())
+                continue;
+            size_t NumArgs = Proto.getArgs().size();
+            size_t DefArgs = It->second.Proto->getArgs().size();
+            if (DefArgs != NumArgs) {
+                fprintf(stderr, "%s: Error: extern '%s' takes %zu arguments "
+                        "but %s defines it with %zu\n",
+                        U->getUnitName().str().c_str(), FnName.str().c_str(),
+                        NumArgs, It->second.Unit->getUnitName().str().c_str(),
+                        DefArgs);
+                OK = false;
+            } else if (!Proto.hasSameSignature(*It->second.Proto)) {
+                fprintf(stderr, "%s: Error: extern '%s' does not take arrays "
+                        "where %s defines it to\n",
+                        U->getUnitName().str().c_str(), FnName.str().c_str(),
+                        It->second.Unit->getUnitName().str().c_str());
+                OK = false;
+            }
+        }
+    }
+    return OK;
+}
+
+// linkProgram - Link the modules of the units into one, in a context of its
+// own, and put it through the full -O3 module pipeline. Only the top-level
+// expressions are called from outside, so everything else is made internal
+// first, for the inliner, IPSCCP, GlobalOpt, DeadArgElim and the function
+// attribute passes to change or delete as they see fit.
+static ThreadSafeModule linkProgram(ArrayRef<std::unique_ptr<CompilerSession>> Units,
+                                    KaleidoscopeJIT &TheJIT) {
+    auto Context = std::make_unique<LLVMContext>();
+    auto M = std::make_unique<Module>("KaleidoscopeJIT", *Context);
+    M->setDataLayout(TheJIT.getDataLayout());
+    StringSet<> Entries;
+    for (auto &U : Units) {
+        for (const PendingExpr &E : U->getPendingExprs())
+            if (!E.IsConstant)
+                Entries.insert(E.Name);
+        // each unit's module is in its own context, so it crosses over as
+        // bitcode
+        SmallVector<char, 0> Bitcode;
+        raw_svector_ostream OS(Bitcode);
+        U->takeModule().withModuleDo([&](Module &UM) { WriteBitcodeToFile(UM, OS); });
+        auto UM = ExitOnErr(parseBitcodeFile(
+            MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), U->getUnitName()),
+            *Context));
+        if (Linker::linkModules(*M, std::move(UM)))
+            ExitOnErr(createStringError(inconvertibleErrorCode(), "could not link %s",
+                                        U->getUnitName().str().c_str()));
+    }
+
+    auto TM = ExitOnErr(TheJIT.createTargetMachine());
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TM.get());
+    TargetLibraryInfoImpl TLII = getTargetLibraryInfo(TM->getTargetTriple());
+    FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    // the pipeline reassociates the chains the functions had balanced back
+    // into lines, so they are balanced again at the end
+    if (BalanceChains)
+        PB.registerOptimizerLastEPCallback([](ModulePassManager &MPM, OptimizationLevel) {
+            MPM.addPass(createModuleToFunctionPassAdaptor(BalanceChainsPass()));
+        });
+
+    ModulePassManager MPM;
+    MPM.addPass(InternalizePass(
+        [&](const GlobalValue &GV) { return Entries.count(GV.getName()) != 0; }));
+    MPM.addPass(PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3));
+    MPM.run(*M, MAM);
+    return ThreadSafeModule(std::move(M), std::move(Context));
+}
+
+// runProgram - Treat the scripts as the units of one program. They are lexed,
+// parsed and code generated in parallel, each into a module and context of its
+// own, then all the modules are added to one JIT, where each unit's externs
+// resolve against the others' definitions; with -whole-script they are
+// linked and optimized as one module instead. Last, the units' top-level
+// expressions are run in command-line order.
+static int runProgram(std::shared_ptr<KaleidoscopeJIT> TheJIT,
+                      MutableArrayRef<ArrayFile> Arrays) {
+    unsigned NumUnits = InputFilenames.size();
+    std::vector<std::unique_ptr<CompilerSession>> Units(NumUnits);
+    std::atomic<unsigned> NextUnit(0);
+    std::atomic<bool> OpenFailed(false);
+
+    auto Worker = [&] {
+        for (unsigned I; (I = NextUnit++) < NumUnits;) {
+            auto Src = openScript(InputFilenames[I]);
+            if (!Src) {
+                OpenFailed = true;
+                continue;
+            }
+            Units[I] = std::make_unique<CompilerSession>(TheJIT);
+            addHostArrays(*Units[I], Arrays);
+            Units[I]->compile(std::move(Src), I);
+        }
+    };
+
+    unsigned NumThreads = Jobs ? Jobs : std::thread::hardware_concurrency();
+    NumThreads = std::max(1u, std::min(NumThreads, NumUnits));
+    std::vector<std::thread> Threads;
+    for (unsigned T = 1; T < NumThreads; ++T)
+        Threads.emplace_back(Worker);
+    Worker();
+    for (auto &T : Threads)
+        T.join();
+
+    if (OpenFailed || !checkUnits(Units))
+        return 1;
+
+    if (WholeScript)
+        ExitOnErr(TheJIT->addModule(linkProgram(Units, *TheJIT)));
+    else
+        for (auto &U : Units)
+            ExitOnErr(TheJIT->addModule(U->takeModule()));
+
+    for (auto &U : Units) {
+        for (const PendingExpr &E : U->getPendingExprs()) {
+            if (E.IsConstant) {
+                fprintf(stderr, "Evaluated to %f\n", E.Value);
+                continue;
+            }
+            auto ExprSymbol = ExitOnErr(TheJIT->lookup(E.Name));
+            double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
+            double Result = FP();
+            // the code of any unit may have run out of bounds, and each
+            // keeps its own errors
+            bool OutOfBounds = false;
+            for (auto &V : Units)
+                OutOfBounds |= V->reportBoundsError();
+            if (!OutOfBounds)
+                fprintf(stderr, "Evaluated to %f\n", Result);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
     InitializeNativeTarget(); 
     InitializeNativeTargetAsmPrinter();
     InitializeNativeTargetAsmParser();
-    // install standard binary operators 
-    // 1 is lowest precedence 
-    BinopPrecedence['<'] = 10; 
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40; // highest
 
-    // prime the first token
-    fprintf(stderr, "ready> "); 
-    getNextToken(); 
-    
-    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
-    InitializeModuleAndManagers();
+    if (!EmitKBC.empty() && InputFilenames.size() != 1) {
+        fprintf(stderr, "Error: -emit-kbc takes exactly one script\n");
+        return 1;
+    }
 
-    // run the main "interpretter loop" now
-    MainLoop(); 
+    // the host's arrays, which live for as long as the scripts run
+    std::vector<ArrayFile> Arrays(ArrayFiles.size());
+    for (size_t I = 0; I != ArrayFiles.size(); ++I)
+        if (!loadHostArray(ArrayFiles[I], Arrays[I]))
+            return 1;
+
+    // several scripts make up one program, compiled in parallel; a script
+    // to be optimized whole is a program of one
+    if (InputFilenames.size() > 1 ||
+        (InputFilenames.size() == 1 && WholeScript && EmitKBC.empty()))
+        return runProgram(ExitOnErr(createJIT()), Arrays);
+
+    auto Session = ExitOnErr(CompilerSession::Create());
+    addHostArrays(*Session, Arrays);
+
+    // with no scripts named, run the main "interpretter loop" on stdin
+    if (InputFilenames.empty()) {
+        Session->run(stdin);
+        return 0;
+    }
+
+    // batch mode: run the script straight through
+    auto Src = openScript(InputFilenames[0]);
+    if (!Src)
+        return 1;
+
+    if (!EmitKBC.empty()) {
+        std::error_code EC;
+        raw_fd_ostream OS(EmitKBC, EC);
+        if (EC) {
+            fprintf(stderr, "Error: could not open %s: %s\n", EmitKBC.c_str(),
+                    EC.message().c_str());
+            return 1;
+        }
+        Session->emitKBC(std::move(Src), OS);
+        return 0;
+    }
+    Session->run(std::move(Src));
 
     return 0;
 }